@@ -43,9 +43,18 @@ void exit_with_help()
 	"-n nu : set the parameter nu of nu-SVC, one-class SVM, and nu-SVR (default 0.5)\n"
 	"-p epsilon : set the epsilon in loss function of epsilon-SVR (default 0.1)\n"
 	"-m cachesize : set cache memory size in MB (default 100)\n"
+	"-M spillsize : set overflow cache size in MB for columns evicted from the cache (default 0)\n"
 	"-e epsilon : set tolerance of termination criterion (default 0.001)\n"
-	"-h shrinking : whether to use the shrinking heuristics, 0 or 1 (default 1)\n"
+	"-h shrinking : whether to use the shrinking heuristics, 0 or 1, or 2 to adapt how often to shrink (default 1)\n"
 	"-b probability_estimates : whether to train a SVC or SVR model for probability estimates, 0 or 1 (default 0)\n"
+	"-j nr_thread : set the number of threads computing kernel columns, 0 for all available (default 0)\n"
+	"-W working_set_size : set the number of variables optimized together per iteration, 2 for the pairwise solver (default 2)\n"
+	"-i max_iter : set the maximum number of iterations per subproblem, 0 for the default limit (default 0)\n"
+	"-T max_time : set the time limit in seconds for the training, 0 for no limit (default 0)\n"
+	"-k checkpoint_file : save the solver state to checkpoint_file periodically, and resume from it if it exists\n"
+	"-K checkpoint_interval : set the seconds between checkpoints (default 600)\n"
+	"-f kernel_file : keep kernel columns in kernel_file, starting from those it has of the same data and kernel\n"
+	"-F kernel_file_size : set the size limit of the kernel file in MB (default 1000)\n"
 	"-wi weight : set the parameter C of class i to weight*C, for C-SVC (default 1)\n"
 	"-v n: n-fold cross validation mode\n"
 	"-q : quiet mode (no outputs)\n"
@@ -54,6 +63,8 @@ void exit_with_help()
 
 // svm arguments
 struct svm_parameter param;		// set by parse_command_line
+static char checkpoint_file_name[1024];	// param.checkpoint_file, outliving the options
+static char kernel_file_name[1024];	// param.kernel_file, the same
 struct svm_problem prob;		// set by read_problem
 struct svm_model *model;
 struct svm_node *x_space;
@@ -120,11 +131,20 @@ int parse_command_line(int nrhs, const mxArray *prhs[], char *model_file_name)
 	param.coef0 = 0;
 	param.nu = 0.5;
 	param.cache_size = 100;
+	param.spill_size = 0;
 	param.C = 1;
 	param.eps = 1e-3;
 	param.p = 0.1;
 	param.shrinking = 1;
 	param.probability = 0;
+	param.nr_thread = 0;
+	param.working_set_size = 2;
+	param.max_iter = 0;
+	param.max_time = 0;
+	param.checkpoint_file = NULL;
+	param.checkpoint_interval = 600;
+	param.kernel_file = NULL;
+	param.kernel_file_size = 1000;
 	param.nr_weight = 0;
 	param.weight_label = NULL;
 	param.weight = NULL;
@@ -172,6 +192,9 @@ int parse_command_line(int nrhs, const mxArray *prhs[], char *model_file_name)
 			case 'm':
 				param.cache_size = atof(argv[i]);
 				break;
+			case 'M':
+				param.spill_size = atof(argv[i]);
+				break;
 			case 'c':
 				param.C = atof(argv[i]);
 				break;
@@ -187,6 +210,32 @@ int parse_command_line(int nrhs, const mxArray *prhs[], char *model_file_name)
 			case 'b':
 				param.probability = atoi(argv[i]);
 				break;
+			case 'j':
+				param.nr_thread = atoi(argv[i]);
+				break;
+			case 'W':
+				param.working_set_size = atoi(argv[i]);
+				break;
+			case 'i':
+				param.max_iter = atoi(argv[i]);
+				break;
+			case 'T':
+				param.max_time = atof(argv[i]);
+				break;
+			case 'k':
+				strncpy(checkpoint_file_name,argv[i],sizeof(checkpoint_file_name)-1);
+				param.checkpoint_file = checkpoint_file_name;
+				break;
+			case 'K':
+				param.checkpoint_interval = atof(argv[i]);
+				break;
+			case 'f':
+				strncpy(kernel_file_name,argv[i],sizeof(kernel_file_name)-1);
+				param.kernel_file = kernel_file_name;
+				break;
+			case 'F':
+				param.kernel_file_size = atof(argv[i]);
+				break;
 			case 'q':
 				print_func = &print_null;
 				i--;
@@ -475,7 +524,10 @@ void mexFunction( int nlhs, mxArray *plhs[],
 		{
 			int nr_feat = (int)mxGetN(prhs[1]);
 			const char *error_msg;
-			model = svm_train(&prob, &param);
+			if(param.checkpoint_file)
+				model = svm_train_resume(&prob, &param);
+			else
+				model = svm_train(&prob, &param);
 			error_msg = model_to_matlab_structure(plhs, nr_feat, model);
 			if(error_msg)
 				mexPrintf("Error: can't convert libsvm model to matrix structure: %s\n", error_msg);
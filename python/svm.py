@@ -27,7 +27,7 @@ try:
 	if sys.platform == 'win32':
 		libsvm = CDLL(path.join(dirname, r'..\windows\libsvm.dll'))
 	else:
-		libsvm = CDLL(path.join(dirname, '../libsvm.so.2'))
+		libsvm = CDLL(path.join(dirname, '../libsvm.so.3'))
 except:
 # For unix the prefix 'lib' is not considered.
 	if find_library('svm'):
@@ -225,10 +225,16 @@ class svm_problem(Structure):
 class svm_parameter(Structure):
 	_names = ["svm_type", "kernel_type", "degree", "gamma", "coef0",
 			"cache_size", "eps", "C", "nr_weight", "weight_label", "weight",
-			"nu", "p", "shrinking", "probability"]
+			"nu", "p", "shrinking", "probability", "num_train", "nr_thread",
+			"working_set_size", "max_iter", "max_time",
+			"checkpoint_file", "checkpoint_interval", "kernel_file", "kernel_file_size",
+			"spill_size"]
 	_types = [c_int, c_int, c_int, c_double, c_double,
 			c_double, c_double, c_double, c_int, POINTER(c_int), POINTER(c_double),
-			c_double, c_double, c_int, c_int]
+			c_double, c_double, c_int, c_int, c_int, c_int,
+			c_int, c_int, c_double,
+			c_char_p, c_double, c_char_p, c_double,
+			c_double]
 	_fields_ = genFields(_names, _types)
 
 	def __init__(self, options = None):
@@ -254,11 +260,21 @@ class svm_parameter(Structure):
 		self.coef0 = 0
 		self.nu = 0.5
 		self.cache_size = 100
+		self.spill_size = 0
 		self.C = 1
 		self.eps = 0.001
 		self.p = 0.1
 		self.shrinking = 1
 		self.probability = 0
+		self.num_train = 0
+		self.nr_thread = 0
+		self.working_set_size = 2
+		self.max_iter = 0
+		self.max_time = 0
+		self.checkpoint_file = None
+		self.checkpoint_interval = 600
+		self.kernel_file = None
+		self.kernel_file_size = 1000
 		self.nr_weight = 0
 		self.weight_label = None
 		self.weight = None
@@ -301,6 +317,9 @@ class svm_parameter(Structure):
 			elif argv[i] == "-m":
 				i = i + 1
 				self.cache_size = float(argv[i])
+			elif argv[i] == "-M":
+				i = i + 1
+				self.spill_size = float(argv[i])
 			elif argv[i] == "-c":
 				i = i + 1
 				self.C = float(argv[i])
@@ -316,6 +335,30 @@ class svm_parameter(Structure):
 			elif argv[i] == "-b":
 				i = i + 1
 				self.probability = int(argv[i])
+			elif argv[i] == "-j":
+				i = i + 1
+				self.nr_thread = int(argv[i])
+			elif argv[i] == "-W":
+				i = i + 1
+				self.working_set_size = int(argv[i])
+			elif argv[i] == "-i":
+				i = i + 1
+				self.max_iter = int(argv[i])
+			elif argv[i] == "-T":
+				i = i + 1
+				self.max_time = float(argv[i])
+			elif argv[i] == "-k":
+				i = i + 1
+				self.checkpoint_file = argv[i].encode()
+			elif argv[i] == "-K":
+				i = i + 1
+				self.checkpoint_interval = float(argv[i])
+			elif argv[i] == "-f":
+				i = i + 1
+				self.kernel_file = argv[i].encode()
+			elif argv[i] == "-F":
+				i = i + 1
+				self.kernel_file_size = float(argv[i])
 			elif argv[i] == "-q":
 				self.print_func = PRINT_STRING_FUN(print_null)
 			elif argv[i] == "-v":
@@ -416,7 +459,11 @@ def toPyModel(model_ptr):
 	return m
 
 fillprototype(libsvm.svm_train, POINTER(svm_model), [POINTER(svm_problem), POINTER(svm_parameter)])
+fillprototype(libsvm.svm_train_resume, POINTER(svm_model), [POINTER(svm_problem), POINTER(svm_parameter)])
+fillprototype(libsvm.svm_train_warm, POINTER(svm_model), [POINTER(svm_problem), POINTER(svm_parameter), POINTER(c_double)])
+fillprototype(libsvm.svm_train_path, POINTER(POINTER(svm_model)), [POINTER(svm_problem), POINTER(svm_parameter), c_int, POINTER(c_double)])
 fillprototype(libsvm.svm_cross_validation, None, [POINTER(svm_problem), POINTER(svm_parameter), c_int, POINTER(c_double)])
+fillprototype(libsvm.svm_grid_search, None, [POINTER(svm_problem), POINTER(svm_parameter), c_int, c_int, POINTER(c_double), c_int, POINTER(c_double), POINTER(c_double)])
 
 fillprototype(libsvm.svm_save_model, c_int, [c_char_p, POINTER(svm_model)])
 fillprototype(libsvm.svm_load_model, POINTER(svm_model), [c_char_p])
@@ -432,6 +479,7 @@ fillprototype(libsvm.svm_predict_values, c_double, [POINTER(svm_model), POINTER(
 fillprototype(libsvm.svm_predict, c_double, [POINTER(svm_model), POINTER(svm_node)])
 fillprototype(libsvm.svm_predict_probability, c_double, [POINTER(svm_model), POINTER(svm_node), POINTER(c_double)])
 
+fillprototype(libsvm.svm_compact_model, None, [POINTER(svm_model)])
 fillprototype(libsvm.svm_free_model_content, None, [POINTER(svm_model)])
 fillprototype(libsvm.svm_free_and_destroy_model, None, [POINTER(POINTER(svm_model))])
 fillprototype(libsvm.svm_destroy_param, None, [POINTER(svm_parameter)])
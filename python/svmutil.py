@@ -74,9 +74,18 @@ def svm_train(arg1, arg2=None, arg3=None):
 	    -n nu : set the parameter nu of nu-SVC, one-class SVM, and nu-SVR (default 0.5)
 	    -p epsilon : set the epsilon in loss function of epsilon-SVR (default 0.1)
 	    -m cachesize : set cache memory size in MB (default 100)
+	    -M spillsize : set overflow cache size in MB for columns evicted from the cache (default 0)
 	    -e epsilon : set tolerance of termination criterion (default 0.001)
-	    -h shrinking : whether to use the shrinking heuristics, 0 or 1 (default 1)
+	    -h shrinking : whether to use the shrinking heuristics, 0 or 1, or 2 to adapt how often to shrink (default 1)
 	    -b probability_estimates : whether to train a SVC or SVR model for probability estimates, 0 or 1 (default 0)
+	    -j nr_thread : set the number of threads computing kernel columns, 0 for all available (default 0)
+	    -W working_set_size : set the number of variables optimized together per iteration, 2 for the pairwise solver (default 2)
+	    -i max_iter : set the maximum number of iterations per subproblem, 0 for the default limit (default 0)
+	    -T max_time : set the time limit in seconds for the training, 0 for no limit (default 0)
+	    -k checkpoint_file : save the solver state to checkpoint_file periodically, and resume from it if it exists
+	    -K checkpoint_interval : set the seconds between checkpoints (default 600)
+	    -f kernel_file : keep kernel columns in kernel_file, starting from those it has of the same data and kernel
+	    -F kernel_file_size : set the size limit of the kernel file in MB (default 1000)
 	    -wi weight : set the parameter C of class i to weight*C, for C-SVC (default 1)
 	    -v n: n-fold cross validation mode
 	    -q : quiet mode (no outputs)
@@ -125,11 +134,13 @@ def svm_train(arg1, arg2=None, arg3=None):
 			print("Cross Validation Accuracy = %g%%" % ACC)
 			return ACC
 	else:
-		m = libsvm.svm_train(prob, param)
+		if param.checkpoint_file:
+			m = libsvm.svm_train_resume(prob, param)
+		else:
+			m = libsvm.svm_train(prob, param)
+		# the model takes a copy of its SVs, so that prob can be freed
+		libsvm.svm_compact_model(m)
 		m = toPyModel(m)
-
-		# If prob is destroyed, data including SVs pointed by m can remain.
-		m.x_space = prob.x_space
 		return m
 
 def svm_predict(y, x, m, options=""):
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include "svm.h"
+#define Malloc(type,n) (type *)malloc((n)*sizeof(type))
+
+void print_null(const char *s) {}
+
+void exit_with_help()
+{
+	printf(
+	"Usage: svm-grid [grid_options] [svm_options] dataset\n"
+	"grid_options:\n"
+	"-log2c {begin,end,step | \"null\"} : set the range of c (default -5,15,2)\n"
+	"	begin,end,step -- c_range = 2^{begin,...,begin+k*step,...,end}\n"
+	"	\"null\"         -- do not grid with c\n"
+	"-log2g {begin,end,step | \"null\"} : set the range of g (default 3,-15,-2)\n"
+	"	begin,end,step -- g_range = 2^{begin,...,begin+k*step,...,end}\n"
+	"	\"null\"         -- do not grid with g\n"
+	"-v n : n-fold cross validation (default 5)\n"
+	"-out {pathname | \"null\"} : (default dataset.out)\n"
+	"	pathname -- set output file path and name\n"
+	"	\"null\"   -- do not output file\n"
+	"svm_options:\n"
+	"-s svm_type : set type of SVM (default 0)\n"
+	"	0 -- C-SVC		(multi-class classification)\n"
+	"	1 -- nu-SVC		(multi-class classification)\n"
+	"	2 -- one-class SVM\n"
+	"	3 -- epsilon-SVR	(regression)\n"
+	"	4 -- nu-SVR		(regression)\n"
+	"-t kernel_type : set type of kernel function (default 2)\n"
+	"	0 -- linear: u'*v\n"
+	"	1 -- polynomial: (gamma*u'*v + coef0)^degree\n"
+	"	2 -- radial basis function: exp(-gamma*|u-v|^2)\n"
+	"	3 -- sigmoid: tanh(gamma*u'*v + coef0)\n"
+	"	4 -- precomputed kernel (kernel values in dataset)\n"
+	"-d degree : set degree in kernel function (default 3)\n"
+	"-r coef0 : set coef0 in kernel function (default 0)\n"
+	"-n nu : set the parameter nu of nu-SVC, one-class SVM, and nu-SVR (default 0.5)\n"
+	"-p epsilon : set the epsilon in loss function of epsilon-SVR (default 0.1)\n"
+	"-m cachesize : set cache memory size in MB (default 100)\n"
+	"-M spillsize : set overflow cache size in MB for columns evicted from the cache (default 0)\n"
+	"-e epsilon : set tolerance of termination criterion (default 0.001)\n"
+	"-h shrinking : whether to use the shrinking heuristics, 0 or 1, or 2 to adapt how often to shrink (default 1)\n"
+	"-b probability_estimates : whether to train a SVC or SVR model for probability estimates, 0 or 1 (default 0)\n"
+	"-j nr_thread : set the number of threads, 0 for all available (default 0)\n"
+	"-W working_set_size : set the number of variables optimized together per iteration, 2 for the pairwise solver (default 2)\n"
+	"-i max_iter : set the maximum number of iterations per subproblem, 0 for the default limit (default 0)\n"
+	"-wi weight : set the parameter C of class i to weight*C, for C-SVC (default 1)\n"
+	"-q : quiet mode (no outputs of the training)\n"
+	);
+	exit(1);
+}
+
+void exit_input_error(int line_num)
+{
+	fprintf(stderr,"Wrong input format at line %d\n", line_num);
+	exit(1);
+}
+
+void parse_command_line(int argc, char **argv, char *input_file_name);
+void read_problem(const char *filename);
+void do_grid_search();
+
+struct svm_parameter param;		// set by parse_command_line
+struct svm_problem prob;		// set by read_problem
+struct svm_node *x_space;
+int nr_fold;
+int grid_with_c, grid_with_g;
+double c_begin, c_end, c_step;
+double g_begin, g_end, g_step;
+char out_file_name[1024];		// empty for no output file
+
+static char *line = NULL;
+static int max_line_len;
+
+static char* readline(FILE *input)
+{
+	int len;
+
+	if(fgets(line,max_line_len,input) == NULL)
+		return NULL;
+
+	while(strrchr(line,'\n') == NULL)
+	{
+		max_line_len *= 2;
+		line = (char *) realloc(line,max_line_len);
+		len = (int) strlen(line);
+		if(fgets(line+len,max_line_len-len,input) == NULL)
+			break;
+	}
+	return line;
+}
+
+int main(int argc, char **argv)
+{
+	char input_file_name[1024];
+	const char *error_msg;
+
+	parse_command_line(argc, argv, input_file_name);
+	read_problem(input_file_name);
+	error_msg = svm_check_parameter(&prob,&param);
+
+	if(error_msg)
+	{
+		fprintf(stderr,"ERROR: %s\n",error_msg);
+		exit(1);
+	}
+
+	do_grid_search();
+
+	svm_destroy_param(&param);
+	free(prob.y);
+	free(prob.x);
+	free(x_space);
+	free(line);
+
+	return 0;
+}
+
+// begin, begin+step, ... up to end
+static int range_f(double begin, double end, double step, double *seq)
+{
+	int n = 0;
+	while(!(step > 0 && begin > end) && !(step < 0 && begin < end))
+	{
+		if(seq)
+			seq[n] = begin;
+		++n;
+		begin = begin + step;
+		if(step == 0)
+			break;
+	}
+	return n;
+}
+
+// the middle first, then the two halves, each in this order, by turns
+static void permute_sequence(const double *seq, int n, double *ret)
+{
+	if(n <= 1)
+	{
+		if(n == 1)
+			ret[0] = seq[0];
+		return;
+	}
+	int mid = n/2;
+	int nr_right = n-mid-1;
+	double *left = Malloc(double,mid);
+	double *right = Malloc(double,nr_right);
+	permute_sequence(seq,mid,left);
+	permute_sequence(seq+mid+1,nr_right,right);
+
+	int i, k = 0;
+	ret[k++] = seq[mid];
+	for(i=0;i<mid || i<nr_right;i++)
+	{
+		if(i < mid)
+			ret[k++] = left[i];
+		if(i < nr_right)
+			ret[k++] = right[i];
+	}
+	free(left);
+	free(right);
+}
+
+// all the points are evaluated at once by svm_grid_search, and reported
+// in the order grid.py runs them: coarse to fine over the grid
+void do_grid_search()
+{
+	int i, j, k;
+	int nr_c = 1, nr_g = 1;
+	double *c_seq = NULL, *g_seq = NULL;
+	double *C = NULL, *gamma = NULL;
+
+	if(grid_with_c)
+	{
+		nr_c = range_f(c_begin,c_end,c_step,NULL);
+		double *seq = Malloc(double,nr_c);
+		range_f(c_begin,c_end,c_step,seq);
+		c_seq = Malloc(double,nr_c);
+		permute_sequence(seq,nr_c,c_seq);
+		free(seq);
+		C = Malloc(double,nr_c);
+		for(i=0;i<nr_c;i++)
+			C[i] = pow(2.0,c_seq[i]);
+	}
+	if(grid_with_g)
+	{
+		nr_g = range_f(g_begin,g_end,g_step,NULL);
+		double *seq = Malloc(double,nr_g);
+		range_f(g_begin,g_end,g_step,seq);
+		g_seq = Malloc(double,nr_g);
+		permute_sequence(seq,nr_g,g_seq);
+		free(seq);
+		gamma = Malloc(double,nr_g);
+		for(i=0;i<nr_g;i++)
+			gamma[i] = pow(2.0,g_seq[i]);
+	}
+	if(nr_c == 0 || nr_g == 0)
+	{
+		fprintf(stderr,"empty range of c or g\n");
+		exit(1);
+	}
+
+	double *rate = Malloc(double,nr_c*nr_g);
+	svm_grid_search(&prob,&param,nr_fold,nr_c,C,nr_g,gamma,rate);
+
+	FILE *out = NULL;
+	if(out_file_name[0])
+	{
+		out = fopen(out_file_name,"w");
+		if(out == NULL)
+		{
+			fprintf(stderr,"can't open output file %s\n",out_file_name);
+			exit(1);
+		}
+	}
+
+	// the mean squared error is to be low for regression, the accuracy high
+	int regression = param.svm_type == EPSILON_SVR || param.svm_type == NU_SVR;
+	int best_c = -1, best_g = -1;
+	double best_rate = 0;
+	i = 0; j = 0;
+	while(i < nr_c || j < nr_g)
+	{
+		int nr_point, inc_c = (double)i/nr_c < (double)j/nr_g;
+		if(inc_c)
+			nr_point = j;
+		else
+			nr_point = i;
+		for(k=0;k<nr_point;k++)
+		{
+			int ci = inc_c ? i : k;
+			int gi = inc_c ? k : j;
+			double r = rate[gi*nr_c+ci];
+			if(best_c < 0 || (regression ? r < best_rate : r > best_rate) ||
+			   (r == best_rate && gi == best_g && c_seq && c_seq[ci] < c_seq[best_c]))
+			{
+				best_rate = r;
+				best_c = ci;
+				best_g = gi;
+			}
+			printf("[local]");
+			if(c_seq)
+				printf(" %g",c_seq[ci]);
+			if(g_seq)
+				printf(" %g",g_seq[gi]);
+			printf(" %g (best ",r);
+			if(c_seq)
+				printf("c=%g, ",C[best_c]);
+			if(g_seq)
+				printf("g=%g, ",gamma[best_g]);
+			printf("rate=%g)\n",best_rate);
+			if(out)
+			{
+				if(c_seq)
+					fprintf(out,"log2c=%g ",c_seq[ci]);
+				if(g_seq)
+					fprintf(out,"log2g=%g ",g_seq[gi]);
+				fprintf(out,"rate=%g\n",r);
+			}
+		}
+		if(inc_c)
+			++i;
+		else
+			++j;
+	}
+	if(c_seq)
+		printf("%g ",C[best_c]);
+	if(g_seq)
+		printf("%g ",gamma[best_g]);
+	printf("%g\n",best_rate);
+
+	if(out)
+		fclose(out);
+	free(rate);
+	free(c_seq);
+	free(g_seq);
+	free(C);
+	free(gamma);
+}
+
+void parse_command_line(int argc, char **argv, char *input_file_name)
+{
+	int i;
+	void (*print_func)(const char*) = NULL;	// default printing to stdout
+	int out_given = 0;
+
+	// default values
+	param.svm_type = C_SVC;
+	param.kernel_type = RBF;
+	param.degree = 3;
+	param.gamma = 0;	// 1/num_features
+	param.coef0 = 0;
+	param.nu = 0.5;
+	param.cache_size = 100;
+	param.spill_size = 0;
+	param.C = 1;
+	param.eps = 1e-3;
+	param.p = 0.1;
+	param.shrinking = 1;
+	param.probability = 0;
+	param.nr_thread = 0;
+	param.working_set_size = 2;
+	param.max_iter = 0;
+	param.max_time = 0;
+	param.checkpoint_file = NULL;
+	param.checkpoint_interval = 600;
+	param.kernel_file = NULL;
+	param.kernel_file_size = 1000;
+	param.nr_weight = 0;
+	param.weight_label = NULL;
+	param.weight = NULL;
+	nr_fold = 5;
+	grid_with_c = 1;
+	grid_with_g = 1;
+	c_begin = -5; c_end = 15; c_step = 2;
+	g_begin = 3; g_end = -15; g_step = -2;
+
+	// parse options
+	for(i=1;i<argc;i++)
+	{
+		if(argv[i][0] != '-') break;
+		if(strcmp(argv[i],"-q") == 0)
+		{
+			print_func = &print_null;
+			continue;
+		}
+		if(++i>=argc)
+			exit_with_help();
+		if(strcmp(argv[i-1],"-log2c") == 0)
+		{
+			if(strcmp(argv[i],"null") == 0)
+				grid_with_c = 0;
+			else if(sscanf(argv[i],"%lf,%lf,%lf",&c_begin,&c_end,&c_step) != 3)
+				exit_with_help();
+			continue;
+		}
+		if(strcmp(argv[i-1],"-log2g") == 0)
+		{
+			if(strcmp(argv[i],"null") == 0)
+				grid_with_g = 0;
+			else if(sscanf(argv[i],"%lf,%lf,%lf",&g_begin,&g_end,&g_step) != 3)
+				exit_with_help();
+			continue;
+		}
+		if(strcmp(argv[i-1],"-out") == 0)
+		{
+			out_given = 1;
+			if(strcmp(argv[i],"null") == 0)
+				out_file_name[0] = '\0';
+			else
+				strcpy(out_file_name,argv[i]);
+			continue;
+		}
+		switch(argv[i-1][1])
+		{
+			case 's':
+				param.svm_type = atoi(argv[i]);
+				break;
+			case 't':
+				param.kernel_type = atoi(argv[i]);
+				break;
+			case 'd':
+				param.degree = atoi(argv[i]);
+				break;
+			case 'r':
+				param.coef0 = atof(argv[i]);
+				break;
+			case 'n':
+				param.nu = atof(argv[i]);
+				break;
+			case 'm':
+				param.cache_size = atof(argv[i]);
+				break;
+			case 'M':
+				param.spill_size = atof(argv[i]);
+				break;
+			case 'e':
+				param.eps = atof(argv[i]);
+				break;
+			case 'p':
+				param.p = atof(argv[i]);
+				break;
+			case 'h':
+				param.shrinking = atoi(argv[i]);
+				break;
+			case 'b':
+				param.probability = atoi(argv[i]);
+				break;
+			case 'j':
+				param.nr_thread = atoi(argv[i]);
+				break;
+			case 'W':
+				param.working_set_size = atoi(argv[i]);
+				break;
+			case 'i':
+				param.max_iter = atoi(argv[i]);
+				break;
+			case 'v':
+				nr_fold = atoi(argv[i]);
+				if(nr_fold < 2)
+				{
+					fprintf(stderr,"n-fold cross validation: n must >= 2\n");
+					exit_with_help();
+				}
+				break;
+			case 'w':
+				++param.nr_weight;
+				param.weight_label = (int *)realloc(param.weight_label,sizeof(int)*param.nr_weight);
+				param.weight = (double *)realloc(param.weight,sizeof(double)*param.nr_weight);
+				param.weight_label[param.nr_weight-1] = atoi(&argv[i-1][2]);
+				param.weight[param.nr_weight-1] = atof(argv[i]);
+				break;
+			case 'c':
+			case 'g':
+				fprintf(stderr,"Use -log2c and -log2g.\n");
+				exit_with_help();
+			default:
+				fprintf(stderr,"Unknown option: %s\n", argv[i-1]);
+				exit_with_help();
+		}
+	}
+
+	if(!grid_with_c && !grid_with_g)
+	{
+		fprintf(stderr,"-log2c and -log2g should not be null simultaneously\n");
+		exit_with_help();
+	}
+
+	svm_set_print_string_function(print_func);
+
+	// determine filenames
+
+	if(i>=argc)
+		exit_with_help();
+
+	strcpy(input_file_name, argv[i]);
+
+	if(!out_given)
+	{
+		char *p = strrchr(argv[i],'/');
+		if(p==NULL)
+			p = argv[i];
+		else
+			++p;
+		sprintf(out_file_name,"%s.out",p);
+	}
+}
+
+// read in a problem (in svmlight format)
+
+void read_problem(const char *filename)
+{
+	int max_index, inst_max_index, i;
+	size_t elements, j;
+	FILE *fp = fopen(filename,"r");
+	char *endptr;
+	char *idx, *val, *label;
+
+	if(fp == NULL)
+	{
+		fprintf(stderr,"can't open input file %s\n",filename);
+		exit(1);
+	}
+
+	prob.l = 0;
+	elements = 0;
+
+	max_line_len = 1024;
+	line = Malloc(char,max_line_len);
+	while(readline(fp)!=NULL)
+	{
+		char *p = strtok(line," \t"); // label
+
+		// features
+		while(1)
+		{
+			p = strtok(NULL," \t");
+			if(p == NULL || *p == '\n') // check '\n' as ' ' may be after the last feature
+				break;
+			++elements;
+		}
+		++elements;
+		++prob.l;
+	}
+	rewind(fp);
+
+	prob.y = Malloc(double,prob.l);
+	prob.x = Malloc(struct svm_node *,prob.l);
+	x_space = Malloc(struct svm_node,elements);
+
+	max_index = 0;
+	j=0;
+	for(i=0;i<prob.l;i++)
+	{
+		inst_max_index = -1; // strtol gives 0 if wrong format, and precomputed kernel has <index> start from 0
+		readline(fp);
+		prob.x[i] = &x_space[j];
+		label = strtok(line," \t\n");
+		if(label == NULL) // empty line
+			exit_input_error(i+1);
+
+		prob.y[i] = strtod(label,&endptr);
+		if(endptr == label || *endptr != '\0')
+			exit_input_error(i+1);
+
+		while(1)
+		{
+			idx = strtok(NULL,":");
+			val = strtok(NULL," \t");
+
+			if(val == NULL)
+				break;
+
+			errno = 0;
+			x_space[j].index = (int) strtol(idx,&endptr,10);
+			if(endptr == idx || errno != 0 || *endptr != '\0' || x_space[j].index <= inst_max_index)
+				exit_input_error(i+1);
+			else
+				inst_max_index = x_space[j].index;
+
+			errno = 0;
+			x_space[j].value = strtod(val,&endptr);
+			if(endptr == val || errno != 0 || (*endptr != '\0' && !isspace(*endptr)))
+				exit_input_error(i+1);
+
+			++j;
+		}
+
+		if(inst_max_index > max_index)
+			max_index = inst_max_index;
+		x_space[j++].index = -1;
+	}
+
+	if(param.gamma == 0 && max_index > 0)
+		param.gamma = 1.0/max_index;
+
+	if(param.kernel_type == PRECOMPUTED)
+		for(i=0;i<prob.l;i++)
+		{
+			if (prob.x[i][0].index != 0)
+			{
+				fprintf(stderr,"Wrong input format: first column must be 0:sample_serial_number\n");
+				exit(1);
+			}
+			if ((int)prob.x[i][0].value <= 0 || (int)prob.x[i][0].value > max_index)
+			{
+				fprintf(stderr,"Wrong input format: sample_serial_number out of range\n");
+				exit(1);
+			}
+		}
+
+	fclose(fp);
+}
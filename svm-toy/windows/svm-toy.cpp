@@ -187,11 +187,20 @@ void button_run_clicked()
 	param.coef0 = 0;
 	param.nu = 0.5;
 	param.cache_size = 100;
+	param.spill_size = 0;
 	param.C = 1;
 	param.eps = 1e-3;
 	param.p = 0.1;
 	param.shrinking = 1;
 	param.probability = 0;
+	param.nr_thread = 0;
+	param.working_set_size = 2;
+	param.max_iter = 0;
+	param.max_time = 0;
+	param.checkpoint_file = NULL;
+	param.checkpoint_interval = 600;
+	param.kernel_file = NULL;
+	param.kernel_file_size = 1000;
 	param.nr_weight = 0;
 	param.weight_label = NULL;
 	param.weight = NULL;
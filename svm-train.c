@@ -3,6 +3,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 #include "svm.h"
 #define Malloc(type,n) (type *)malloc((n)*sizeof(type))
 
@@ -32,9 +35,18 @@ void exit_with_help()
 	"-n nu : set the parameter nu of nu-SVC, one-class SVM, and nu-SVR (default 0.5)\n"
 	"-p epsilon : set the epsilon in loss function of epsilon-SVR (default 0.1)\n"
 	"-m cachesize : set cache memory size in MB (default 100)\n"
+	"-M spillsize : set overflow cache size in MB for columns evicted from the cache (default 0)\n"
 	"-e epsilon : set tolerance of termination criterion (default 0.001)\n"
-	"-h shrinking : whether to use the shrinking heuristics, 0 or 1 (default 1)\n"
+	"-h shrinking : whether to use the shrinking heuristics, 0 or 1, or 2 to adapt how often to shrink (default 1)\n"
 	"-b probability_estimates : whether to train a SVC or SVR model for probability estimates, 0 or 1 (default 0)\n"
+	"-j nr_thread : set the number of threads computing kernel columns, 0 for all available (default 0)\n"
+	"-W working_set_size : set the number of variables optimized together per iteration, 2 for the pairwise solver (default 2)\n"
+	"-i max_iter : set the maximum number of iterations per subproblem, 0 for the default limit (default 0)\n"
+	"-T max_time : set the time limit in seconds for the training, 0 for no limit (default 0)\n"
+	"-k checkpoint_file : save the solver state to checkpoint_file periodically, and resume from it if it exists\n"
+	"-K checkpoint_interval : set the seconds between checkpoints (default 600)\n"
+	"-f kernel_file : keep kernel columns in kernel_file, starting from those it has of the same data and kernel\n"
+	"-F kernel_file_size : set the size limit of the kernel file in MB (default 1000)\n"
 	"-wi weight : set the parameter C of class i to weight*C, for C-SVC (default 1)\n"
 	"-v n: n-fold cross validation mode\n"
 	"-q : quiet mode (no outputs)\n"
@@ -51,6 +63,7 @@ void exit_input_error(int line_num)
 void parse_command_line(int argc, char **argv, char *input_file_name, char *model_file_name);
 void read_problem(const char *filename);
 void do_cross_validation();
+void print_peak_rss(const char *phase);
 
 struct svm_parameter param;		// set by parse_command_line
 struct svm_problem prob;		// set by read_problem
@@ -58,6 +71,7 @@ struct svm_model *model;
 struct svm_node *x_space;
 int cross_validation;
 int nr_fold;
+int quiet;
 
 static char *line = NULL;
 static int max_line_len;
@@ -88,6 +102,7 @@ int main(int argc, char **argv)
 
 	parse_command_line(argc, argv, input_file_name, model_file_name);
 	read_problem(input_file_name);
+	print_peak_rss("reading");
 	error_msg = svm_check_parameter(&prob,&param);
 
 	if(error_msg)
@@ -102,13 +117,25 @@ int main(int argc, char **argv)
 	}
 	else
 	{
-		model = svm_train(&prob,&param);
+		if(param.checkpoint_file)
+			model = svm_train_resume(&prob,&param);
+		else
+			model = svm_train(&prob,&param);
+		// the model keeps a copy of its SVs, and the data goes before saving
+		svm_compact_model(model);
+		free(prob.y);
+		free(prob.x);
+		free(x_space);
+		prob.y = NULL;
+		prob.x = NULL;
+		x_space = NULL;
 		if(svm_save_model(model_file_name,model))
 		{
 			fprintf(stderr, "can't save model to file %s\n", model_file_name);
 			exit(1);
 		}
 		svm_free_and_destroy_model(&model);
+		print_peak_rss("saving");
 	}
 	svm_destroy_param(&param);
 	free(prob.y);
@@ -119,6 +146,21 @@ int main(int argc, char **argv)
 	return 0;
 }
 
+// the peak resident set size so far, where getrusage gives it
+void print_peak_rss(const char *phase)
+{
+#ifndef _WIN32
+	struct rusage usage;
+	if(quiet || getrusage(RUSAGE_SELF,&usage) != 0)
+		return;
+#ifdef __APPLE__
+	printf("peak RSS after %s = %.1f MB\n",phase,(double)usage.ru_maxrss/(1<<20));
+#else
+	printf("peak RSS after %s = %.1f MB\n",phase,(double)usage.ru_maxrss/(1<<10));
+#endif
+#endif
+}
+
 void do_cross_validation()
 {
 	int i;
@@ -162,6 +204,7 @@ void parse_command_line(int argc, char **argv, char *input_file_name, char *mode
 {
 	int i;
 	void (*print_func)(const char*) = NULL;	// default printing to stdout
+	quiet = 0;
 
 	// default values
 	param.svm_type = C_SVC;
@@ -171,11 +214,20 @@ void parse_command_line(int argc, char **argv, char *input_file_name, char *mode
 	param.coef0 = 0;
 	param.nu = 0.5;
 	param.cache_size = 100;
+	param.spill_size = 0;
 	param.C = 1;
 	param.eps = 1e-3;
 	param.p = 0.1;
 	param.shrinking = 1;
 	param.probability = 0;
+	param.nr_thread = 0;
+	param.working_set_size = 2;
+	param.max_iter = 0;
+	param.max_time = 0;
+	param.checkpoint_file = NULL;
+	param.checkpoint_interval = 600;
+	param.kernel_file = NULL;
+	param.kernel_file_size = 1000;
 	param.nr_weight = 0;
 	param.weight_label = NULL;
 	param.weight = NULL;
@@ -210,6 +262,9 @@ void parse_command_line(int argc, char **argv, char *input_file_name, char *mode
 			case 'm':
 				param.cache_size = atof(argv[i]);
 				break;
+			case 'M':
+				param.spill_size = atof(argv[i]);
+				break;
 			case 'c':
 				param.C = atof(argv[i]);
 				break;
@@ -225,8 +280,33 @@ void parse_command_line(int argc, char **argv, char *input_file_name, char *mode
 			case 'b':
 				param.probability = atoi(argv[i]);
 				break;
+			case 'j':
+				param.nr_thread = atoi(argv[i]);
+				break;
+			case 'W':
+				param.working_set_size = atoi(argv[i]);
+				break;
+			case 'i':
+				param.max_iter = atoi(argv[i]);
+				break;
+			case 'T':
+				param.max_time = atof(argv[i]);
+				break;
+			case 'k':
+				param.checkpoint_file = argv[i];
+				break;
+			case 'K':
+				param.checkpoint_interval = atof(argv[i]);
+				break;
+			case 'f':
+				param.kernel_file = argv[i];
+				break;
+			case 'F':
+				param.kernel_file_size = atof(argv[i]);
+				break;
 			case 'q':
 				print_func = &print_null;
+				quiet = 1;
 				i--;
 				break;
 			case 'v':
@@ -7,6 +7,28 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <locale.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_DISPATCH
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
 #include "svm.h"
 int libsvm_version = LIBSVM_VERSION;
 typedef float Qfloat;
@@ -58,53 +80,153 @@ static void info(const char *fmt,...)
 static void info(const char *fmt,...) {}
 #endif
 
+// seconds from some fixed point, for timing parts of the training
+static double wall_time()
+{
+#ifdef _OPENMP
+	return omp_get_wtime();
+#elif defined(_WIN32)
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart/(double)freq.QuadPart;
+#else
+	// clock() would count the CPU time of the process instead
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+#endif
+}
+
+// the peak resident set size of the process so far in MB, 0 where it
+// is not known
+static double peak_rss()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF,&usage) == 0)
+#ifdef __APPLE__
+		return (double)usage.ru_maxrss/(1<<20);	// in bytes there
+#else
+		return (double)usage.ru_maxrss/(1<<10);
+#endif
+#endif
+	return 0;
+}
+
+static void report_peak_rss(const char *phase)
+{
+	double rss = peak_rss();
+	if(rss > 0)
+		info("peak RSS after %s = %.1f MB\n",phase,rss);
+}
+
 //
 // Kernel Cache
 //
 // l is the number of total data items
 // size is the cache size limit in bytes
+// spill_size is the limit in bytes of the second tier, an overflow
+// cache for columns evicted from the LRU list
 //
 class Cache
 {
 public:
-	Cache(int l,long int size);
+	Cache(int l,long int size,long int spill_size);
 	~Cache();
 
 	// request data [0,len)
 	// return some position p where [p,len) need to be filled
 	// (p >= len if nothing needs to be filled)
 	int get_data(const int index, Qfloat **data, int len);
+	// Q is symmetric: copy into data[start,len) of column i the entries
+	// of cached columns other than i and skip, and put the rows left to
+	// compute in rows[0,n); return n; only valid right after get_data
+	int harvest(int i, int start, int len, Qfloat *data, int skip, int *rows) const;
+	// the same for the rows in[0,n) instead of [start,len)
+	int harvest_rows(int i, const int *in, int n, Qfloat *data, int skip, int *rows) const;
+	// whether get_data(index,..,len) would find [0,len) in either tier
+	bool has_data(int index, int len) const
+	{
+		return head[index].len >= len || head[index].spill_len >= len;
+	}
+	// copy buf[0,len) into the cache as column index
+	void put_data(int index, const Qfloat *buf, int len);
+	// requests so far found whole in either tier, and the others
+	void get_counts(long int *hit, long int *miss) const
+	{
+		*hit = nr_hit + nr_spill_hit;
+		*miss = nr_miss;
+	}
 	void swap_index(int i, int j);
 private:
 	int l;
 	long int size;
+	long int spill_size;
+	long int spill_limit;
 	struct head_t
 	{
 		head_t *prev, *next;	// a circular list
 		Qfloat *data;
 		int len;		// data[0,len) is cached in this entry
+
+		head_t *spill_prev, *spill_next;	// a circular list of spilled entries
+		unsigned char *spill;	// data[0,spill_len) saved after eviction
+		int spill_len;
+		int spill_bytes;
 	};
 
 	head_t *head;
 	head_t lru_head;
+	head_t spill_head;
+	long int nr_hit, nr_spill_hit, nr_miss;
+
+	// row swaps not yet applied to the cached columns; shrinking swaps
+	// many rows in a row, and applying them together visits each column
+	// once instead of once per swap
+	int *pending;		// pairs (i,j), i<j
+	int nr_pending;
+	void flush_swaps();
 	void lru_delete(head_t *h);
 	void lru_insert(head_t *h);
+	void spill_delete(head_t *h);
+	void spill_insert(head_t *h);
+	void spill_free(head_t *h);
+	void spill_out(head_t *h);
+	int spill_in(head_t *h, int len);
+	bool spill_swap(head_t *h, int i, int j);
 };
 
-Cache::Cache(int l_,long int size_):l(l_),size(size_)
+//
+// A spilled column is stored either raw or, when at least half of its
+// entries are zero, as a bitmap of the nonzero positions followed by the
+// nonzero values.  Both forms are lossless.
+//
+enum { SPILL_RAW, SPILL_SPARSE };
+
+Cache::Cache(int l_,long int size_,long int spill_size_):l(l_),size(size_),spill_size(spill_size_),spill_limit(spill_size_)
 {
 	head = (head_t *)calloc(l,sizeof(head_t));	// initialized to 0
 	size /= sizeof(Qfloat);
 	size -= l * sizeof(head_t) / sizeof(Qfloat);
 	size = max(size, 2 * (long int) l);	// cache must be large enough for two columns
 	lru_head.next = lru_head.prev = &lru_head;
+	spill_head.spill_next = spill_head.spill_prev = &spill_head;
+	nr_hit = nr_spill_hit = nr_miss = 0;
+	pending = new int[2*l];
+	nr_pending = 0;
 }
 
 Cache::~Cache()
 {
+	if(spill_limit > 0)
+		info("cache hits = %ld, spill hits = %ld, misses = %ld\n",nr_hit,nr_spill_hit,nr_miss);
 	for(head_t *h = lru_head.next; h != &lru_head; h=h->next)
 		free(h->data);
+	for(head_t *h = spill_head.spill_next; h != &spill_head; h=h->spill_next)
+		free(h->spill);
 	free(head);
+	delete[] pending;
 }
 
 void Cache::lru_delete(head_t *h)
@@ -123,19 +245,126 @@ void Cache::lru_insert(head_t *h)
 	h->next->prev = h;
 }
 
+void Cache::spill_delete(head_t *h)
+{
+	h->spill_prev->spill_next = h->spill_next;
+	h->spill_next->spill_prev = h->spill_prev;
+}
+
+void Cache::spill_insert(head_t *h)
+{
+	h->spill_next = &spill_head;
+	h->spill_prev = spill_head.spill_prev;
+	h->spill_prev->spill_next = h;
+	h->spill_next->spill_prev = h;
+}
+
+void Cache::spill_free(head_t *h)
+{
+	free(h->spill);
+	spill_size += h->spill_bytes;
+	h->spill = 0;
+	h->spill_len = 0;
+	h->spill_bytes = 0;
+}
+
+// move the column of an entry leaving the LRU list to the second tier
+void Cache::spill_out(head_t *h)
+{
+	int len = h->len;
+	int nnz = 0;
+	for(int k=0;k<len;k++)
+		if(h->data[k] != 0) ++nnz;
+
+	int mode = SPILL_RAW;
+	int bytes = 1 + (int)sizeof(Qfloat)*len;
+	if(2*nnz <= len)
+	{
+		mode = SPILL_SPARSE;
+		bytes = 1 + (len+7)/8 + (int)sizeof(Qfloat)*nnz;
+	}
+	if(bytes > spill_limit)
+		return;
+
+	// free old space
+	while(spill_size < bytes && spill_head.spill_next != &spill_head)
+	{
+		head_t *old = spill_head.spill_next;
+		spill_delete(old);
+		spill_free(old);
+	}
+	if(spill_size < bytes)
+		return;
+
+	unsigned char *buf = (unsigned char *)malloc(bytes);
+	buf[0] = (unsigned char)mode;
+	if(mode == SPILL_RAW)
+		memcpy(buf+1,h->data,sizeof(Qfloat)*len);
+	else
+	{
+		unsigned char *mask = buf+1;
+		unsigned char *val = mask+(len+7)/8;
+		memset(mask,0,(len+7)/8);
+		for(int k=0;k<len;k++)
+			if(h->data[k] != 0)
+			{
+				mask[k>>3] |= (unsigned char)(1<<(k&7));
+				memcpy(val,&h->data[k],sizeof(Qfloat));
+				val += sizeof(Qfloat);
+			}
+	}
+
+	h->spill = buf;
+	h->spill_len = len;
+	h->spill_bytes = bytes;
+	spill_size -= bytes;
+	spill_insert(h);
+}
+
+// restore h->data[0,min(len,spill_len)) from the second tier
+// return the number of restored entries
+int Cache::spill_in(head_t *h, int len)
+{
+	int n = min(len,h->spill_len);
+	const unsigned char *buf = h->spill;
+	if(buf[0] == SPILL_RAW)
+		memcpy(h->data,buf+1,sizeof(Qfloat)*n);
+	else
+	{
+		const unsigned char *mask = buf+1;
+		const unsigned char *val = mask+(h->spill_len+7)/8;
+		for(int k=0;k<n;k++)
+			if(mask[k>>3] & (1<<(k&7)))
+			{
+				memcpy(&h->data[k],val,sizeof(Qfloat));
+				val += sizeof(Qfloat);
+			}
+			else
+				h->data[k] = 0;
+	}
+	spill_free(h);
+	return n;
+}
+
 int Cache::get_data(const int index, Qfloat **data, int len)
 {
+	if(nr_pending) flush_swaps();
 	head_t *h = &head[index];
 	if(h->len) lru_delete(h);
 	int more = len - h->len;
 
 	if(more > 0)
 	{
+		// keep our own spilled column from being recycled below
+		if(h->spill) spill_delete(h);
+
 		// free old space
 		while(size < more)
 		{
 			head_t *old = lru_head.next;
 			lru_delete(old);
+			if(spill_limit > 0)
+				spill_out(old);
 			free(old->data);
 			size += old->len;
 			old->data = 0;
@@ -146,13 +375,82 @@ int Cache::get_data(const int index, Qfloat **data, int len)
 		h->data = (Qfloat *)realloc(h->data,sizeof(Qfloat)*len);
 		size -= more;
 		swap(h->len,len);
+
+		if(h->spill)
+		{
+			len = spill_in(h,h->len);
+			++nr_spill_hit;
+		}
+		else
+			++nr_miss;
 	}
+	else
+		++nr_hit;
 
 	lru_insert(h);
 	*data = h->data;
 	return len;
 }
 
+void Cache::put_data(int index, const Qfloat *buf, int len)
+{
+	Qfloat *data;
+	int start = get_data(index,&data,len);
+	if(start < len)
+		memcpy(data+start,buf+start,sizeof(Qfloat)*(size_t)(len-start));
+}
+
+int Cache::harvest(int i, int start, int len, Qfloat *data, int skip, int *rows) const
+{
+	// head[j].len tells whether column j has row i
+	int n = 0;
+	for(int j=start;j<len;j++)
+	{
+		const head_t *h = &head[j];
+		if(h->len > i && j != i && j != skip)
+			data[j] = h->data[i];
+		else
+			rows[n++] = j;
+	}
+	return n;
+}
+
+int Cache::harvest_rows(int i, const int *in, int n, Qfloat *data, int skip, int *rows) const
+{
+	int m = 0;
+	for(int k=0;k<n;k++)
+	{
+		int j = in[k];
+		const head_t *h = &head[j];
+		if(h->len > i && j != i && j != skip)
+			data[j] = h->data[i];
+		else
+			rows[m++] = j;
+	}
+	return m;
+}
+
+// swap entries i and j (i<j) of a spilled column, or drop the column
+// if that cannot be done in place; return whether it is kept
+bool Cache::spill_swap(head_t *h, int i, int j)
+{
+	if(h->spill_len <= i)
+		return true;
+	if(h->spill_len > j && h->spill[0] == SPILL_RAW)
+	{
+		Qfloat *d = (Qfloat *)(h->spill+1);
+		Qfloat ti, tj;
+		memcpy(&ti,&d[i],sizeof(Qfloat));
+		memcpy(&tj,&d[j],sizeof(Qfloat));
+		memcpy(&d[i],&tj,sizeof(Qfloat));
+		memcpy(&d[j],&ti,sizeof(Qfloat));
+		return true;
+	}
+	spill_delete(h);
+	spill_free(h);
+	return false;
+}
+
 void Cache::swap_index(int i, int j)
 {
 	if(i==j) return;
@@ -164,211 +462,2174 @@ void Cache::swap_index(int i, int j)
 	if(head[i].len) lru_insert(&head[i]);
 	if(head[j].len) lru_insert(&head[j]);
 
+	if(head[i].spill) spill_delete(&head[i]);
+	if(head[j].spill) spill_delete(&head[j]);
+	swap(head[i].spill,head[j].spill);
+	swap(head[i].spill_len,head[j].spill_len);
+	swap(head[i].spill_bytes,head[j].spill_bytes);
+	if(head[i].spill) spill_insert(&head[i]);
+	if(head[j].spill) spill_insert(&head[j]);
+
 	if(i>j) swap(i,j);
-	for(head_t *h = lru_head.next; h!=&lru_head; h=h->next)
+	if(nr_pending == l) flush_swaps();
+	pending[2*nr_pending] = i;
+	pending[2*nr_pending+1] = j;
+	++nr_pending;
+}
+
+// the row swaps of a column are applied in order, so the result is
+// the same as swapping all columns at each swap_index
+void Cache::flush_swaps()
+{
+	const int *end = pending + 2*nr_pending;
+	for(head_t *h = lru_head.next; h!=&lru_head;)
 	{
-		if(h->len > i)
+		head_t *next = h->next;
+		for(const int *q = pending; q < end; q += 2)
 		{
-			if(h->len > j)
-				swap(h->data[i],h->data[j]);
-			else
+			int i = q[0], j = q[1];
+			if(h->len > i)
 			{
-				// give up
-				lru_delete(h);
-				free(h->data);
-				size += h->len;
-				h->data = 0;
-				h->len = 0;
+				if(h->len > j)
+					swap(h->data[i],h->data[j]);
+				else
+				{
+					// give up
+					lru_delete(h);
+					free(h->data);
+					size += h->len;
+					h->data = 0;
+					h->len = 0;
+					break;
+				}
 			}
 		}
+		h = next;
+	}
+
+	for(head_t *h = spill_head.spill_next; h!=&spill_head;)
+	{
+		head_t *next = h->spill_next;
+		for(const int *q = pending; q < end; q += 2)
+			if(!spill_swap(h,q[0],q[1]))
+				break;
+		h = next;
 	}
+	nr_pending = 0;
 }
 
 //
-// Kernel evaluation
+// Kernel cache shared by the problems of svm_train over its instances
 //
-// the static method k_function is for doing single kernel evaluation
-// the constructor of Kernel prepares to calculate the l*l kernel matrix
-// the member function get_Q is for getting one column from the Q Matrix
+// l instances in groups, group c being [start[c],start[c]+count[c]).
+// A column is kept in segments, one per group, and a segment is put in
+// once some problem has computed the column over the whole group. With
+// own_group only the segment of the group of the instance itself is
+// kept: for the one-against-one problems the groups are the classes,
+// whose values within are needed by every problem of the class. Else
+// all are kept (at most MAX_GROUP groups): for cross validation the
+// groups are the folds, each fold needing the segments of the others.
+// A problem takes these for the columns its own cache misses and
+// computes only the rows left. The problems may run on several
+// threads; a segment is put in once and never changed, so only taking
+// its pointer needs a critical section. Segments are put in until the
+// cache takes max_size bytes (0 for no limit), which the caller reserves.
 //
-class QMatrix {
+class SharedCache
+{
 public:
-	virtual Qfloat *get_Q(int column, int len) const = 0;
-	virtual double *get_QD() const = 0;
-	virtual void swap_index(int i, int j) const = 0;
-	virtual ~QMatrix() {}
+	enum { MAX_GROUP = 16 };
+	SharedCache(int l, int nr_group, const int *start, const int *count, bool own_group,
+		    long int max_size);
+	~SharedCache();
+
+	// whether some of column g is there
+	bool has_data(int g) const;
+	// of a problem whose variable k is instance index[k] with label
+	// y[k] (1 if y is NULL): data[k] = y[i]*y[k]*K(index[i],index[k])
+	// for the k in [start,len) it has; put the other k in rows and
+	// return their number, or return -1 if none of the column is there
+	int get_data(int i, const int *index, const schar *y,
+		     int start, int len, Qfloat *data, int *rows);
+	// keep what is missing of column index[i] from the full column
+	// data[0,n) of variable i
+	void put_data(int i, const int *index, const schar *y, int n, const Qfloat *data);
+	// columns found, and not found
+	void get_counts(long int *hit, long int *miss) const
+	{
+		*hit = nr_hit;
+		*miss = nr_miss;
+	}
+	// the bytes a cache of these groups takes
+	static double size(int l, int nr_group, const int *count, bool own_group);
+private:
+	int l;
+	int nr_group;
+	int nr_slot;	// segments per column, 1 with own_group
+	int *start;
+	int *count;
+	int *group;	// the group of each instance
+	Qfloat **segment;	// segment s of column g at g*nr_slot+s
+	long int max_size, used;
+	long int nr_hit, nr_miss;
+	// the slot of the segment of column g with row h, -1 if not kept
+	int slot(int g, int h) const
+	{
+		if(nr_slot > 1)
+			return group[h];
+		return group[h] == group[g] ? 0 : -1;
+	}
+	// take the segments of column g, returning whether any is there
+	bool get_segments(int g, const Qfloat **seg) const;
 };
 
-class Kernel: public QMatrix {
-public:
-	Kernel(int l, svm_node * const * x, const svm_parameter& param);
-	virtual ~Kernel();
+SharedCache::SharedCache(int l_, int nr_group_, const int *start_, const int *count_, bool own_group,
+			 long int max_size_)
+:l(l_), nr_group(nr_group_), max_size(max_size_)
+{
+	nr_slot = own_group ? 1 : nr_group;
+	used = (long int)l*(long int)(nr_slot*sizeof(Qfloat *)+sizeof(int));
+	clone(start,start_,nr_group);
+	clone(count,count_,nr_group);
+	group = new int[l];
+	for(int c=0;c<nr_group;c++)
+		for(int k=0;k<count[c];k++)
+			group[start[c]+k] = c;
+	segment = (Qfloat **)calloc((size_t)l*nr_slot,sizeof(Qfloat *));	// initialized to 0
+	nr_hit = nr_miss = 0;
+}
 
-	static double k_function(const svm_node *x, const svm_node *y,
-				 const svm_parameter& param);
-	virtual Qfloat *get_Q(int column, int len) const = 0;
-	virtual double *get_QD() const = 0;
-	virtual void swap_index(int i, int j) const	// no so const...
+SharedCache::~SharedCache()
+{
+	for(long int s=0;s<(long int)l*nr_slot;s++)
+		free(segment[s]);
+	free(segment);
+	delete[] group;
+	delete[] count;
+	delete[] start;
+}
+
+double SharedCache::size(int l, int nr_group, const int *count, bool own_group)
+{
+	double n = 0;
+	for(int c=0;c<nr_group;c++)
+		n += (double)count[c]*count[c];
+	if(!own_group)
+		n = (double)l*l;
+	int nr_slot = own_group ? 1 : nr_group;
+	return n*sizeof(Qfloat) + (double)l*(nr_slot*(double)sizeof(Qfloat *)+(double)sizeof(int));
+}
+
+bool SharedCache::get_segments(int g, const Qfloat **seg) const
+{
+	bool found = false;
+	const Qfloat *const *p = segment + (long int)g*nr_slot;
+#ifdef _OPENMP
+#pragma omp critical(shared_cache)
+#endif
+	for(int s=0;s<nr_slot;s++)
 	{
-		swap(x[i],x[j]);
-		if(x_square) swap(x_square[i],x_square[j]);
+		seg[s] = p[s];
+		if(seg[s])
+			found = true;
 	}
-protected:
-
-	double (Kernel::*kernel_function)(int i, int j) const;
+	return found;
+}
 
-private:
-	const svm_node **x;
-	double *x_square;
+bool SharedCache::has_data(int g) const
+{
+	const Qfloat *seg[MAX_GROUP];
+	return get_segments(g,seg);
+}
 
-	// svm_parameter
-	const int kernel_type;
-	const int degree;
-	const double gamma;
-	const double coef0;
+int SharedCache::get_data(int i, const int *index, const schar *y,
+			  int start_, int len, Qfloat *data, int *rows)
+{
+	int g = index[i];
+	const Qfloat *seg[MAX_GROUP];
+	if(!get_segments(g,seg))
+	{
+#ifdef _OPENMP
+#pragma omp atomic update
+#endif
+		++nr_miss;
+		return -1;
+	}
+#ifdef _OPENMP
+#pragma omp atomic update
+#endif
+	++nr_hit;
 
-	static double dot(const svm_node *px, const svm_node *py);
-	double kernel_linear(int i, int j) const
+	int n = 0;
+	if(nr_slot == 1)
 	{
-		return dot(x[i],x[j]);
+		int c = group[g];
+		const Qfloat *d = seg[0] - start[c];
+		for(int k=start_;k<len;k++)
+		{
+			int h = index[k];
+			if(group[h] != c)
+				rows[n++] = k;
+			else if(y)
+				data[k] = (Qfloat)(y[i]*y[k]) * d[h];
+			else
+				data[k] = d[h];
+		}
 	}
-	double kernel_poly(int i, int j) const
+	else
+		for(int k=start_;k<len;k++)
+		{
+			int h = index[k];
+			int c = group[h];
+			if(!seg[c])
+				rows[n++] = k;
+			else if(y)
+				data[k] = (Qfloat)(y[i]*y[k]) * seg[c][h-start[c]];
+			else
+				data[k] = seg[c][h-start[c]];
+		}
+	return n;
+}
+void SharedCache::put_data(int i, const int *index, const schar *y, int n, const Qfloat *data)
+{
+	int g = index[i];
+	const Qfloat *seg[MAX_GROUP];
+	bool full = true;
+	Qfloat **p = segment + (long int)g*nr_slot;
+#ifdef _OPENMP
+#pragma omp critical(shared_cache)
+#endif
 	{
-		return powi(gamma*dot(x[i],x[j])+coef0,degree);
+		for(int s=0;s<nr_slot;s++)
+		{
+			seg[s] = p[s];
+			if(!seg[s])
+				full = false;
+		}
+		if(max_size > 0 && used >= max_size)
+			full = true;
 	}
-	double kernel_rbf(int i, int j) const
+	if(full)
+		return;
+
+	// a missing segment is kept if the column has all of its group
+	int m[MAX_GROUP];
+	Qfloat *d[MAX_GROUP];
+	for(int s=0;s<nr_slot;s++)
+		m[s] = 0;
+	for(int k=0;k<n;k++)
 	{
-		return exp(-gamma*(x_square[i]+x_square[j]-2*dot(x[i],x[j])));
+		int s = slot(g,index[k]);
+		if(s >= 0)
+			++m[s];
 	}
-	double kernel_sigmoid(int i, int j) const
+	for(int s=0;s<nr_slot;s++)
 	{
-		return tanh(gamma*dot(x[i],x[j])+coef0);
+		int c = nr_slot > 1 ? s : group[g];
+		d[s] = !seg[s] && m[s] == count[c] ? Malloc(Qfloat,count[c]) : NULL;
 	}
-	double kernel_precomputed(int i, int j) const
+	for(int k=0;k<n;k++)
 	{
-		return x[i][(int)(x[j][0].value)].value;
+		int h = index[k];
+		int s = slot(g,h);
+		if(s >= 0 && d[s])
+			d[s][h-start[group[h]]] = y ? (Qfloat)(y[i]*y[k]) * data[k] : data[k];
+	}
+#ifdef _OPENMP
+#pragma omp critical(shared_cache)
+#endif
+	for(int s=0;s<nr_slot;s++)
+	{
+		// else another thread was first, or the budget is used
+		long int bytes = (long int)sizeof(Qfloat)*count[nr_slot > 1 ? s : group[g]];
+		if(d[s] && !p[s] && (max_size == 0 || used+bytes <= max_size))
+		{
+			p[s] = d[s];
+			d[s] = NULL;
+			used += bytes;
+		}
 	}
+	for(int s=0;s<nr_slot;s++)
+		free(d[s]);
+}
+
+//
+// Kernel columns kept in a file over runs
+//
+// The columns of K over the l instances of the problem trained on are
+// kept, unsigned, in nr_slot slots of a file mapped into memory, so
+// that a later training on the same instances and kernel starts with
+// them. The file begins with a hash of the instances and the kernel
+// parameters and the number of their nonzeros, and a file of others is
+// started anew. Once all slots
+// are taken a column goes in the one taken longest ago. The problems of
+// a training take the instances of the problem it is given, so an
+// instance is found by its svm_node pointer; a problem having only some
+// of them puts in their rows, the others being NaN until some problem
+// puts them in. The file is locked, being used by one process at a
+// time; the threads of one take critical(kernel_file) sections.
+//
+struct kernel_file_header
+{
+	char magic[8];
+	unsigned long long hash;
+	long long nnz;
+	int l;
+	int nr_slot;
+	int next;	// the slot to take next
 };
 
-Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
-:kernel_type(param.kernel_type), degree(param.degree),
- gamma(param.gamma), coef0(param.coef0)
+static const char kernel_file_magic[8] = {'L','S','V','M','K','E','R','2'};
+
+class KernelFile
 {
-	switch(kernel_type)
+public:
+	KernelFile(const svm_problem *prob);
+	~KernelFile();
+	// map file_name in at most max_size bytes, keeping its columns if
+	// they are of this hash; false if it cannot be used
+	bool open(const char *file_name, unsigned long long hash, double max_size);
+	// the instance x is in the problem, -1 if none
+	int find(const svm_node *x) const;
+
+	// whether some of column g is there
+	bool has_data(int g) const;
+	// as SharedCache::get_data, for a problem whose variable k is
+	// instance index[k]
+	int get_data(int i, const int *index, const schar *y,
+		     int start, int len, Qfloat *data, int *rows);
+	// put in the rows data[0,n) of column i of such a problem
+	void put_data(int i, const int *index, const schar *y, int n, const Qfloat *data);
+	void get_counts(long int *hit, long int *miss) const
 	{
-		case LINEAR:
-			kernel_function = &Kernel::kernel_linear;
-			break;
-		case POLY:
-			kernel_function = &Kernel::kernel_poly;
-			break;
-		case RBF:
-			kernel_function = &Kernel::kernel_rbf;
-			break;
-		case SIGMOID:
-			kernel_function = &Kernel::kernel_sigmoid;
-			break;
-		case PRECOMPUTED:
-			kernel_function = &Kernel::kernel_precomputed;
-			break;
+		*hit = nr_hit;
+		*miss = nr_miss;
 	}
+private:
+	int l;
+	long long nnz;
+	// the instances by pointer, in a table of open addressing
+	int hash_mask;
+	const svm_node **key;
+	int *value;
+
+	int fd;
+	char *map;
+	size_t map_size;
+	kernel_file_header *header;
+	int *slot_of;	// the slot of each column, -1 if none
+	int *owner;	// the column in each slot, -1 if none
+	Qfloat *column;
+	long int nr_hit, nr_miss;
+
+	int hash(const svm_node *x) const
+	{
+		return (int)(((size_t)x/sizeof(svm_node)*2654435761u) & (size_t)hash_mask);
+	}
+	size_t file_size(int nr_slot) const
+	{
+		return sizeof(kernel_file_header) + 2*sizeof(int)*(size_t)l + sizeof(Qfloat)*(size_t)l*(size_t)nr_slot;
+	}
+	bool map_file(size_t size);
+};
 
-	clone(x,x_,l);
-
-	if(kernel_type == RBF)
+KernelFile::KernelFile(const svm_problem *prob)
+:l(prob->l)
+{
+	nnz = 0;
+	for(int i=0;i<l;i++)
+		for(const svm_node *px=prob->x[i];px->index != -1;px++)
+			++nnz;
+	int n = 1;
+	while(n < 2*l)
+		n *= 2;
+	hash_mask = n-1;
+	key = new const svm_node *[n];
+	value = new int[n];
+	for(int h=0;h<n;h++)
+		key[h] = NULL;
+	for(int i=0;i<l;i++)
 	{
-		x_square = new double[l];
-		for(int i=0;i<l;i++)
-			x_square[i] = dot(x[i],x[i]);
+		int h = hash(prob->x[i]);
+		while(key[h] && key[h] != prob->x[i])
+			h = (h+1) & hash_mask;
+		if(!key[h])
+		{
+			key[h] = prob->x[i];
+			value[h] = i;
+		}
 	}
-	else
-		x_square = 0;
+	fd = -1;
+	map = NULL;
+	map_size = 0;
+	nr_hit = nr_miss = 0;
 }
 
-Kernel::~Kernel()
+KernelFile::~KernelFile()
 {
-	delete[] x;
-	delete[] x_square;
+#ifndef _WIN32
+	if(map)
+		munmap(map,map_size);
+	if(fd >= 0)
+		close(fd);	// and the lock with it
+#endif
+	delete[] key;
+	delete[] value;
 }
 
-double Kernel::dot(const svm_node *px, const svm_node *py)
+int KernelFile::find(const svm_node *x) const
 {
-	double sum = 0;
-	while(px->index != -1 && py->index != -1)
-	{
-		if(px->index == py->index)
-		{
-			sum += px->value * py->value;
-			++px;
-			++py;
-		}
-		else
-		{
-			if(px->index > py->index)
-				++py;
-			else
-				++px;
-		}
-	}
-	return sum;
+	for(int h=hash(x);key[h];h=(h+1) & hash_mask)
+		if(key[h] == x)
+			return value[h];
+	return -1;
 }
 
-double Kernel::k_function(const svm_node *x, const svm_node *y,
-			  const svm_parameter& param)
+bool KernelFile::map_file(size_t size)
 {
-	switch(param.kernel_type)
-	{
-		case LINEAR:
+#ifndef _WIN32
+	void *p = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if(p == MAP_FAILED)
+		return false;
+	map = (char *)p;
+	map_size = size;
+	header = (kernel_file_header *)map;
+	slot_of = (int *)(map+sizeof(kernel_file_header));
+	owner = slot_of+l;
+	column = (Qfloat *)(owner+l);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool KernelFile::open(const char *file_name, unsigned long long hash_, double max_size)
+{
+#ifdef _WIN32
+	fprintf(stderr,"WARNING: kernel file %s is not supported on this system\n",file_name);
+	return false;
+#else
+	double n = (max_size-(double)file_size(0))/((double)sizeof(Qfloat)*l);
+	if(n < 1)
+	{
+		fprintf(stderr,"WARNING: kernel file %s cannot hold a column in its size\n",file_name);
+		return false;
+	}
+	int nr_slot = (int)min(n,(double)l);
+
+	fd = ::open(file_name,O_RDWR|O_CREAT,0666);
+	if(fd < 0)
+	{
+		fprintf(stderr,"WARNING: cannot open kernel file %s\n",file_name);
+		return false;
+	}
+	if(flock(fd,LOCK_EX|LOCK_NB) != 0)
+	{
+		fprintf(stderr,"WARNING: kernel file %s is in use, training without it\n",file_name);
+		return false;
+	}
+
+	// the columns are kept if the file is of these instances and kernel
+	kernel_file_header h;
+	struct stat st;
+	bool found = fstat(fd,&st) == 0 && st.st_size > 0;
+	bool keep = found && read(fd,&h,sizeof(h)) == (ssize_t)sizeof(h) &&
+		    memcmp(h.magic,kernel_file_magic,8) == 0 && h.hash == hash_ && h.nnz == nnz && h.l == l &&
+		    h.nr_slot >= 1 && h.nr_slot <= l && h.next >= 0 && h.next < h.nr_slot &&
+		    (size_t)st.st_size == file_size(h.nr_slot);
+	size_t size = file_size(nr_slot);
+	size_t old_size = keep ? file_size(h.nr_slot) : 0;
+	if(ftruncate(fd,(off_t)max(size,old_size)) != 0 || !map_file(max(size,old_size)))
+	{
+		fprintf(stderr,"WARNING: cannot map kernel file %s\n",file_name);
+		return false;
+	}
+
+	if(!keep)
+	{
+		if(found)
+			info("kernel file %s is not of this problem, starting it anew\n",file_name);
+		memset(header->magic,0,8);
+		header->hash = hash_;
+		header->nnz = nnz;
+		header->l = l;
+		header->nr_slot = nr_slot;
+		header->next = 0;
+		for(int k=0;k<l;k++)
+			slot_of[k] = owner[k] = -1;
+		memcpy(header->magic,kernel_file_magic,8);
+	}
+	else if(h.nr_slot != nr_slot)
+	{
+		// resized: the columns past the slots are dropped, and new
+		// slots are taken first
+		for(int s=nr_slot;s<h.nr_slot;s++)
+			if(owner[s] >= 0)
+			{
+				slot_of[owner[s]] = -1;
+				owner[s] = -1;
+			}
+		if(h.nr_slot < nr_slot)
+			header->next = h.nr_slot;
+		else if(header->next >= nr_slot)
+			header->next = 0;
+		header->nr_slot = nr_slot;
+		if(old_size > size)
+		{
+			munmap(map,map_size);
+			map = NULL;
+			if(ftruncate(fd,(off_t)size) != 0 || !map_file(size))
+			{
+				fprintf(stderr,"WARNING: cannot map kernel file %s\n",file_name);
+				return false;
+			}
+		}
+	}
+	return true;
+#endif
+}
+
+bool KernelFile::has_data(int g) const
+{
+	bool found;
+#ifdef _OPENMP
+#pragma omp critical(kernel_file)
+#endif
+	found = slot_of[g] >= 0;
+	return found;
+}
+
+int KernelFile::get_data(int i, const int *index, const schar *y,
+			 int start, int len, Qfloat *data, int *rows)
+{
+	int n = -1;
+#ifdef _OPENMP
+#pragma omp critical(kernel_file)
+#endif
+	{
+		int s = slot_of[index[i]];
+		if(s >= 0)
+		{
+			const Qfloat *d = column+(size_t)s*l;
+			n = 0;
+			for(int k=start;k<len;k++)
+			{
+				Qfloat v = d[index[k]];
+				if(v != v)
+					rows[n++] = k;
+				else if(y)
+					data[k] = (Qfloat)(y[i]*y[k]) * v;
+				else
+					data[k] = v;
+			}
+			++nr_hit;
+		}
+		else
+			++nr_miss;
+	}
+	return n;
+}
+
+void KernelFile::put_data(int i, const int *index, const schar *y, int n, const Qfloat *data)
+{
+	int g = index[i];
+#ifdef _OPENMP
+#pragma omp critical(kernel_file)
+#endif
+	{
+		int s = slot_of[g];
+		if(s < 0)
+		{
+			s = header->next;
+			header->next = (s+1)%header->nr_slot;
+			if(owner[s] >= 0)
+				slot_of[owner[s]] = -1;
+			memset(column+(size_t)s*l,0xff,sizeof(Qfloat)*(size_t)l);	// NaN
+			owner[s] = g;
+			slot_of[g] = s;
+		}
+		Qfloat *d = column+(size_t)s*l;
+		for(int k=0;k<n;k++)
+		{
+			Qfloat *p = &d[index[k]];
+			if(*p != *p)
+				*p = y ? (Qfloat)(y[i]*y[k]) * data[k] : data[k];
+		}
+	}
+}
+
+//
+// Elementwise exp and tanh for the column kernels
+//
+// they have no branches or library calls, and clamp or select in the
+// integer domain, so that the loops calling them can be vectorized; the
+// error is a few ulps, far below the precision of Qfloat
+//
+static inline double exp_elem(double x)
+{
+	// below -746 the result is 0 and above 710 it is inf; clamping keeps
+	// n within what the shift below rounds exactly
+	x = x < -746.0 ? -746.0 : x;
+	x = x > 710.0 ? 710.0 : x;
+
+	// x = n*log(2) + r, |r| <= log(2)/2
+	const double shift = 6755399441055744.0;	// 1.5*2^52
+	double t = x*1.4426950408889634 + shift;
+	double n = t - shift;
+	double r = x - n*6.93147180369123816490e-01 - n*1.90821492927058770002e-10;
+
+	double p = 1.0/6227020800.0;
+	p = p*r + 1.0/479001600.0;
+	p = p*r + 1.0/39916800.0;
+	p = p*r + 1.0/3628800.0;
+	p = p*r + 1.0/362880.0;
+	p = p*r + 1.0/40320.0;
+	p = p*r + 1.0/5040.0;
+	p = p*r + 1.0/720.0;
+	p = p*r + 1.0/120.0;
+	p = p*r + 1.0/24.0;
+	p = p*r + 1.0/6.0;
+	p = p*r + 0.5;
+	p = p*r + 1.0;
+	p = p*r + 1.0;
+
+	// scale by 2^n in two steps so that subnormal results are handled
+	long long bits, n1, n2;
+	memcpy(&bits,&t,sizeof(bits));
+	int k = (int)(bits - 0x4338000000000000LL);
+	k = k < -1100 ? -1100 : k;
+	k = k > 1100 ? 1100 : k;
+	n1 = k >> 1;
+	n2 = k - n1;
+	n1 = (n1 + 1023) << 52;
+	n2 = (n2 + 1023) << 52;
+	double s1, s2;
+	memcpy(&s1,&n1,sizeof(s1));
+	memcpy(&s2,&n2,sizeof(s2));
+	return p*s1*s2;
+}
+
+static inline double tanh_elem(double x)
+{
+	double a = fabs(x);
+
+	// tanh(a) = e/(e+2) with e = exp(2a)-1; a Taylor series gives e
+	// without cancellation for small a
+	double z = 2*a;
+	double e = 1.0/1307674368000.0;
+	e = e*z + 1.0/87178291200.0;
+	e = e*z + 1.0/6227020800.0;
+	e = e*z + 1.0/479001600.0;
+	e = e*z + 1.0/39916800.0;
+	e = e*z + 1.0/3628800.0;
+	e = e*z + 1.0/362880.0;
+	e = e*z + 1.0/40320.0;
+	e = e*z + 1.0/5040.0;
+	e = e*z + 1.0/720.0;
+	e = e*z + 1.0/120.0;
+	e = e*z + 1.0/24.0;
+	e = e*z + 1.0/6.0;
+	e = e*z + 0.5;
+	e = e*z + 1.0;
+	e = e*z;
+	double small = e/(e+2);
+	double large = 1 - 2/(exp_elem(z)+1);
+
+	// take small if a < 0.25, i.e. the high word of a is below 0x3FD00000
+	long long bits, small_bits, large_bits;
+	memcpy(&bits,&a,sizeof(bits));
+	memcpy(&small_bits,&small,sizeof(small_bits));
+	memcpy(&large_bits,&large,sizeof(large_bits));
+	long long mask = -(long long)((int)(bits >> 32) < 0x3FD00000);
+	bits = (small_bits & mask) | (large_bits & ~mask);
+	double t;
+	memcpy(&t,&bits,sizeof(t));
+	return copysign(t,x);
+}
+
+//
+// Kernel evaluation
+//
+// the static method k_function is for doing single kernel evaluation
+// the constructor of Kernel prepares to calculate the l*l kernel matrix
+// the member function get_Q is for getting one column from the Q Matrix
+// kernel_column fills (part of) a column in blocks; it is specialized
+// for each kernel type and for signed (SVC) or unsigned columns
+//
+class QMatrix {
+public:
+	virtual Qfloat *get_Q(int column, int len) const = 0;
+	// two columns at once, for the pair updated in an iteration
+	virtual void get_Q2(int i, int j, int len, Qfloat **Q_i, Qfloat **Q_j) const
+	{
+		*Q_i = get_Q(i,len);
+		*Q_j = get_Q(j,len);
+	}
+	// prefetching: prefetch_len is how many entries to compute ahead
+	// for column i, 0 if the cache has it; compute_Q computes entries
+	// [start,end) into buf without touching the cache, so it may run
+	// while other threads read cached columns, and store_Q puts
+	// buf[0,len) into the cache afterwards
+	virtual int prefetch_len(int i, int len) const { return 0; }
+	// column requests found whole in the cache, and the others
+	virtual void cache_counts(long int *hit, long int *miss) const { *hit = *miss = 0; }
+	virtual void compute_Q(int i, int start, int end, Qfloat *buf) const {}
+	virtual void store_Q(int i, int len, const Qfloat *buf) const {}
+	virtual double *get_QD() const = 0;
+	virtual void swap_index(int i, int j) const = 0;
+	virtual ~QMatrix() {}
+};
+
+class Kernel: public QMatrix {
+public:
+	// over x[index[k]] for k in [0,l), or x[0,l) if index is NULL
+	Kernel(int l, svm_node * const * x, const int *index, const svm_parameter& param);
+	virtual ~Kernel();
+
+	static double k_function(const svm_node *x, const svm_node *y,
+				 const svm_parameter& param);
+	virtual Qfloat *get_Q(int column, int len) const = 0;
+	virtual double *get_QD() const = 0;
+	virtual void swap_index(int i, int j) const	// no so const...
+	{
+		swap(x[i],x[j]);
+		if(x_square) swap(x_square[i],x_square[j]);
+		if(pos)
+		{
+			swap(id[i],id[j]);
+			pos[id[i]] = i;
+			pos[id[j]] = j;
+		}
+		if(shared_index) swap(shared_index[i],shared_index[j]);
+		if(file_index) swap(file_index[i],file_index[j]);
+	}
+protected:
+
+	double (Kernel::*kernel_function)(int i, int j) const;
+
+	// data[j] = K(i,j) for j in [start,len), times y[i]*y[j] if y is not NULL
+	void kernel_column(int i, int start, int len, Qfloat *data, const schar *y) const;
+	// the same in double, unsigned
+	void kernel_column(int i, int start, int len, double *data) const;
+	// the same for the rows rows[0,n) of column i
+	void kernel_rows(int i, const int *rows, int n, Qfloat *data, const schar *y) const;
+	// the same for columns i and j, missing from start_i and start_j,
+	// reading each x[k] once where both are missing
+	void kernel_column2(int i, int start_i, Qfloat *data_i,
+			    int j, int start_j, Qfloat *data_j,
+			    int len, const schar *y) const;
+
+	// fill data[start,len) of column i, or of columns i and j, taking
+	// what the cached columns have and computing the rest
+	void fill_column(const Cache *cache, int i, int start, int len, Qfloat *data, const schar *y) const;
+	void fill_column2(const Cache *cache, int i, int start_i, Qfloat *data_i,
+			  int j, int start_j, Qfloat *data_j,
+			  int len, const schar *y) const;
+	// the same for the rows in[0,n) of column i, skipping column skip
+	void fill_rows(const Cache *cache, int i, const int *in, int n, Qfloat *data,
+		       int skip, const schar *y) const;
+
+	// the kernel cache shared with other problems, NULL if unused, and
+	// the instance in it of each of the l variables
+	SharedCache *shared;
+	int *shared_index;
+	void share(SharedCache *cache, const int *index, int l);
+	// fill data[start,len) of column i from the shared cache and the
+	// cached columns as fill_column does, with skip being filled too;
+	// false if the shared cache has too little of it, leaving it to the
+	// caller
+	bool take_shared(const Cache *cache, int i, int start, int len, Qfloat *data,
+			 int skip, const schar *y) const;
+
+	// the kernel file, NULL if unused, and the instance in it of each
+	// of the l variables; take_shared looks there too when the shared
+	// cache has too little of a column
+	KernelFile *file;
+	int *file_index;
+	void use_file(KernelFile *file, int l);
+	// whether columns are shared or kept in the file
+	bool sharing() const { return shared || file; }
+	// whether some of column i is there
+	bool has_shared(int i) const
+	{
+		return (shared && shared->has_data(shared_index[i])) ||
+		       (file && file->has_data(file_index[i]));
+	}
+	// put in the full column data[0,l) of variable i
+	void put_shared(int i, int l, const Qfloat *data, const schar *y) const
+	{
+		if(shared)
+			shared->put_data(i,shared_index,y,l,data);
+		if(file)
+			file->put_data(i,file_index,y,l,data);
+	}
+
+private:
+	const svm_node **x;
+	double *x_square;
+
+	// svm_parameter
+	const int kernel_type;
+	const int degree;
+	const double gamma;
+	const double coef0;
+	int nr_thread;
+
+	// dot products of a column are computed by scattering x[i] into a
+	// dense array or, for large indices, a hash table, and gathering it
+	// with each x[j]; sparse data may instead go through an inverted
+	// index: the instances having feature f are
+	// post_id[post_start[f],post_start[f+1]) with values post_value,
+	// where f is the index itself or, for large indices, numbered by
+	// a hash table
+	double avg_nnz;
+	double *dense;
+	double *dense_pair;	// two columns interleaved
+	int hash_mask;
+	int *hash_key;
+	double *hash_value;
+	int feature_mask;
+	int *feature_key;
+	int *feature_id;
+	int *post_start;
+	int *post_id;
+	double *post_value;
+	int *id;	// original instance at each position
+	int *pos;	// position of each original instance
+	double *acc;
+	int *rows;	// rows of a column not found in the cache
+	int *missing;	// rows of a column not found in the shared cache
+
+	void init_column(int l);
+	int feature(int index) const;
+	void scatter(const svm_node *px) const;
+	void unscatter(const svm_node *px) const;
+	double gather(const svm_node *py) const;
+	void scatter_pair(const svm_node *px, const svm_node *py) const;
+	void unscatter_pair(const svm_node *px, const svm_node *py) const;
+	void gather_pair(const svm_node *pz, double *sum_x, double *sum_y) const;
+	void accumulate(const svm_node *px, int start, int len) const;
+	int column_mode(int i, int start, int len) const;
+
+	static double dot(const svm_node *px, const svm_node *py);
+	double kernel_linear(int i, int j) const
+	{
+		return dot(x[i],x[j]);
+	}
+	double kernel_poly(int i, int j) const
+	{
+		return powi(gamma*dot(x[i],x[j])+coef0,degree);
+	}
+	double kernel_rbf(int i, int j) const
+	{
+		return exp(-gamma*(x_square[i]+x_square[j]-2*dot(x[i],x[j])));
+	}
+	double kernel_sigmoid(int i, int j) const
+	{
+		return tanh(gamma*dot(x[i],x[j])+coef0);
+	}
+	double kernel_precomputed(int i, int j) const
+	{
+		return x[i][(int)(x[j][0].value)].value;
+	}
+
+	template<int KT>
+	void kernel_values(int i, int b, int n, double *buf, double *tmp) const;
+	template<int KT, bool SIGNED, class T>
+	void kernel_column_block(int i, int start, int len, T *data, const schar *y) const;
+	template<int KT, bool SIGNED>
+	void kernel_rows_block(int i, const int *rows, int n, Qfloat *data, const schar *y) const;
+	template<int KT, bool SIGNED>
+	void kernel_pair_block(int i, int j, int start, int len, Qfloat *data_i, Qfloat *data_j, const schar *y) const;
+};
+
+Kernel::Kernel(int l, svm_node * const * x_, const int *index, const svm_parameter& param)
+:kernel_type(param.kernel_type), degree(param.degree),
+ gamma(param.gamma), coef0(param.coef0)
+{
+	switch(kernel_type)
+	{
+		case LINEAR:
+			kernel_function = &Kernel::kernel_linear;
+			break;
+		case POLY:
+			kernel_function = &Kernel::kernel_poly;
+			break;
+		case RBF:
+			kernel_function = &Kernel::kernel_rbf;
+			break;
+		case SIGMOID:
+			kernel_function = &Kernel::kernel_sigmoid;
+			break;
+		case PRECOMPUTED:
+			kernel_function = &Kernel::kernel_precomputed;
+			break;
+	}
+
+	if(index)
+	{
+		x = new const svm_node *[l];
+		for(int k=0;k<l;k++)
+			x[k] = x_[index[k]];
+	}
+	else
+		clone(x,x_,l);
+
+	if(kernel_type == RBF)
+	{
+		x_square = new double[l];
+		for(int i=0;i<l;i++)
+			x_square[i] = dot(x[i],x[i]);
+	}
+	else
+		x_square = 0;
+
+	init_column(l);
+	rows = new int[l];
+	shared = NULL;
+	shared_index = NULL;
+	file = NULL;
+	file_index = NULL;
+	missing = NULL;
+
+#ifdef _OPENMP
+	nr_thread = param.nr_thread > 0 ? param.nr_thread : omp_get_max_threads();
+#else
+	nr_thread = 1;
+#endif
+}
+
+Kernel::~Kernel()
+{
+	delete[] x;
+	delete[] x_square;
+	delete[] dense;
+	delete[] dense_pair;
+	delete[] hash_key;
+	delete[] hash_value;
+	delete[] feature_key;
+	delete[] feature_id;
+	delete[] post_start;
+	delete[] post_id;
+	delete[] post_value;
+	delete[] id;
+	delete[] pos;
+	delete[] acc;
+	delete[] rows;
+	delete[] shared_index;
+	delete[] file_index;
+	delete[] missing;
+}
+
+// index spaces up to this size are scattered into a dense array, if
+// there are at least DENSE_NNZ_PER_INDEX nonzeros an index: the dense
+// arrays take 24 bytes an index, and each kernel of a subproblem, fold
+// or thread has its own, so sparse data with large indices takes the
+// hash table, of twice the largest instance
+#define DENSE_INDEX_LIMIT (1<<20)
+#define DENSE_NNZ_PER_INDEX 8
+
+enum { COLUMN_MERGE, COLUMN_DENSE, COLUMN_HASH, COLUMN_INVERTED };
+
+void Kernel::init_column(int l)
+{
+	dense = 0;
+	dense_pair = 0;
+	hash_mask = 0;
+	hash_key = 0;
+	hash_value = 0;
+	feature_mask = 0;
+	feature_key = 0;
+	feature_id = 0;
+	post_start = 0;
+	post_id = 0;
+	post_value = 0;
+	id = 0;
+	pos = 0;
+	acc = 0;
+	avg_nnz = 0;
+
+	if(kernel_type == PRECOMPUTED || l == 0)
+		return;
+
+	int i, max_index = 0, max_nnz = 0;
+	long int nnz = 0;
+	const svm_node *p;
+	for(i=0;i<l;i++)
+	{
+		for(p=x[i];p->index!=-1;p++)
+		{
+			if(p->index < 0)
+				return;		// leave such data to dot()
+			max_index = max(max_index,p->index);
+		}
+		max_nnz = max(max_nnz,(int)(p-x[i]));
+		nnz += p-x[i];
+	}
+	avg_nnz = (double)nnz/l;
+
+	if(max_index < DENSE_INDEX_LIMIT && (long int)(max_index+1)*DENSE_NNZ_PER_INDEX <= nnz)
+	{
+		dense = new double[max_index+1];
+		dense_pair = new double[2*(max_index+1)];
+		for(i=0;i<=max_index;i++)
+			dense[i] = 0;
+		for(i=0;i<2*(max_index+1);i++)
+			dense_pair[i] = 0;
+	}
+	else
+	{
+		int size = 1;
+		while(size < 2*max_nnz)
+			size *= 2;
+		hash_mask = size-1;
+		hash_key = new int[size];
+		hash_value = new double[size];
+		for(i=0;i<size;i++)
+			hash_key[i] = -1;
+	}
+
+	// number the features
+	int nr_feature = max_index+1;
+	if(dense == 0)
+	{
+		int size = 1;
+		while(size < 2*nnz)
+			size *= 2;
+		feature_mask = size-1;
+		feature_key = new int[size];
+		feature_id = new int[size];
+		for(i=0;i<size;i++)
+			feature_key[i] = -1;
+		nr_feature = 0;
+		for(i=0;i<l;i++)
+			for(p=x[i];p->index!=-1;p++)
+			{
+				int h = (int)(((unsigned int)p->index*2654435761u)&(unsigned int)feature_mask);
+				while(feature_key[h] != -1 && feature_key[h] != p->index)
+					h = (h+1)&feature_mask;
+				if(feature_key[h] == -1)
+				{
+					feature_key[h] = p->index;
+					feature_id[h] = nr_feature++;
+				}
+			}
+	}
+
+	// an inverted index pays off if a column touches, on average,
+	// sum_f df(f)^2/l postings, well below the nnz a gather touches
+	post_start = new int[nr_feature+1];
+	for(i=0;i<=nr_feature;i++)
+		post_start[i] = 0;
+	for(i=0;i<l;i++)
+		for(p=x[i];p->index!=-1;p++)
+			++post_start[feature(p->index)+1];
+	double sum_df2 = 0;
+	for(i=1;i<=nr_feature;i++)
+		sum_df2 += (double)post_start[i]*post_start[i];
+	if(4*sum_df2 >= (double)nnz*l)
+	{
+		delete[] post_start;
+		delete[] feature_key;
+		delete[] feature_id;
+		post_start = 0;
+		feature_key = 0;
+		feature_id = 0;
+		return;
+	}
+
+	for(i=1;i<=nr_feature;i++)
+		post_start[i] += post_start[i-1];
+	post_id = new int[nnz];
+	post_value = new double[nnz];
+	int *fill = new int[nr_feature];
+	memcpy(fill,post_start,sizeof(int)*nr_feature);
+	for(i=0;i<l;i++)
+		for(p=x[i];p->index!=-1;p++)
+		{
+			int f = feature(p->index);
+			post_id[fill[f]] = i;
+			post_value[fill[f]] = p->value;
+			++fill[f];
+		}
+	delete[] fill;
+
+	id = new int[l];
+	pos = new int[l];
+	acc = new double[l];
+	for(i=0;i<l;i++)
+		id[i] = pos[i] = i;
+}
+
+// number of a feature in the inverted index; every feature of x has one
+int Kernel::feature(int index) const
+{
+	if(feature_key == 0)
+		return index;
+	int h = (int)(((unsigned int)index*2654435761u)&(unsigned int)feature_mask);
+	while(feature_key[h] != index)
+		h = (h+1)&feature_mask;
+	return feature_id[h];
+}
+
+void Kernel::scatter(const svm_node *px) const
+{
+	if(dense)
+		for(;px->index!=-1;px++)
+			dense[px->index] = px->value;
+	else
+		for(;px->index!=-1;px++)
+		{
+			int h = (int)(((unsigned int)px->index*2654435761u)&(unsigned int)hash_mask);
+			while(hash_key[h] != -1)
+				h = (h+1)&hash_mask;
+			hash_key[h] = px->index;
+			hash_value[h] = px->value;
+		}
+}
+
+void Kernel::unscatter(const svm_node *px) const
+{
+	if(dense)
+		for(;px->index!=-1;px++)
+			dense[px->index] = 0;
+	else
+		// all keys of px go, so probing on past emptied slots is fine
+		for(;px->index!=-1;px++)
+		{
+			int h = (int)(((unsigned int)px->index*2654435761u)&(unsigned int)hash_mask);
+			while(hash_key[h] != px->index)
+				h = (h+1)&hash_mask;
+			hash_key[h] = -1;
+		}
+}
+
+// same sum as dot(), in the same order, but without the merge
+double Kernel::gather(const svm_node *py) const
+{
+	double sum = 0;
+	if(dense)
+		for(;py->index!=-1;py++)
+			sum += dense[py->index] * py->value;
+	else
+		for(;py->index!=-1;py++)
+		{
+			int h = (int)(((unsigned int)py->index*2654435761u)&(unsigned int)hash_mask);
+			while(hash_key[h] != -1)
+			{
+				if(hash_key[h] == py->index)
+				{
+					sum += hash_value[h] * py->value;
+					break;
+				}
+				h = (h+1)&hash_mask;
+			}
+		}
+	return sum;
+}
+
+void Kernel::scatter_pair(const svm_node *px, const svm_node *py) const
+{
+	for(;px->index!=-1;px++)
+		dense_pair[2*px->index] = px->value;
+	for(;py->index!=-1;py++)
+		dense_pair[2*py->index+1] = py->value;
+}
+
+void Kernel::unscatter_pair(const svm_node *px, const svm_node *py) const
+{
+	for(;px->index!=-1;px++)
+		dense_pair[2*px->index] = 0;
+	for(;py->index!=-1;py++)
+		dense_pair[2*py->index+1] = 0;
+}
+
+// gather() of both scattered columns
+void Kernel::gather_pair(const svm_node *pz, double *sum_x, double *sum_y) const
+{
+	double sx = 0, sy = 0;
+	for(;pz->index!=-1;pz++)
+	{
+		const double *d = &dense_pair[2*pz->index];
+		sx += d[0] * pz->value;
+		sy += d[1] * pz->value;
+	}
+	*sum_x = sx;
+	*sum_y = sy;
+}
+
+// acc[j] = dot(x[i],x[j]) for j in [start,len) from the inverted index
+void Kernel::accumulate(const svm_node *px, int start, int len) const
+{
+	int j;
+	for(j=start;j<len;j++)
+		acc[j] = 0;
+	for(;px->index!=-1;px++)
+	{
+		double v = px->value;
+		int f = feature(px->index);
+		for(int t=post_start[f];t<post_start[f+1];t++)
+		{
+			j = pos[post_id[t]];
+			if(j >= start && j < len)
+				acc[j] += v * post_value[t];
+		}
+	}
+}
+
+int Kernel::column_mode(int i, int start, int len) const
+{
+	if(dense == 0 && hash_key == 0)
+		return COLUMN_MERGE;
+	if(post_start)
+	{
+		double postings = 0;
+		for(const svm_node *p=x[i];p->index!=-1;p++)
+		{
+			int f = feature(p->index);
+			postings += post_start[f+1]-post_start[f];
+		}
+		if(4*postings < (len-start)*avg_nnz)
+			return COLUMN_INVERTED;
+	}
+	return dense ? COLUMN_DENSE : COLUMN_HASH;
+}
+
+// entries are computed this many at a time: first the dot products,
+// then the kernel function over the whole block
+#define COLUMN_BLOCK 256
+// blocks are spread over threads if a column fill has this many entries
+#define PARALLEL_COLUMN_MIN 2048
+
+// turn the dot products buf[0,n) of column i at rows [b,b+n) into
+// kernel values; tmp is scratch
+template<int KT>
+inline void Kernel::kernel_values(int i, int b, int n, double *buf, double *tmp) const
+{
+	int k;
+	if(KT == POLY)
+	{
+		for(k=0;k<n;k++)
+		{
+			tmp[k] = gamma*buf[k]+coef0;
+			buf[k] = 1.0;
+		}
+		for(int t=degree; t>0; t/=2)
+		{
+			if(t%2==1)
+				for(k=0;k<n;k++)
+					buf[k] *= tmp[k];
+			for(k=0;k<n;k++)
+				tmp[k] = tmp[k] * tmp[k];
+		}
+	}
+	else if(KT == RBF)
+	{
+		const double xsq_i = x_square[i];
+		const double *xsq = &x_square[b];
+		for(k=0;k<n;k++)
+			buf[k] = exp_elem(-gamma*(xsq_i+xsq[k]-2*buf[k]));
+	}
+	else if(KT == SIGMOID)
+	{
+		for(k=0;k<n;k++)
+			buf[k] = tanh_elem(gamma*buf[k]+coef0);
+	}
+}
+
+template<int KT, bool SIGNED, class T>
+void Kernel::kernel_column_block(int i, int start, int len, T *data, const schar *y) const
+{
+	const svm_node *px = x[i];
+	int mode = KT == PRECOMPUTED ? COLUMN_MERGE : column_mode(i,start,len);
+
+	// scattering is serial; the blocks only read what it wrote and
+	// each entry is computed the same way by whichever thread gets it
+	if(mode == COLUMN_INVERTED)
+		accumulate(px,start,len);
+	else if(mode != COLUMN_MERGE)
+		scatter(px);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && len-start >= PARALLEL_COLUMN_MIN)
+#endif
+	for(int b=start;b<len;b+=COLUMN_BLOCK)
+	{
+		double buf[COLUMN_BLOCK];
+		double tmp[COLUMN_BLOCK];
+		int n = min(len-b,COLUMN_BLOCK);
+		int k;
+
+		if(KT == PRECOMPUTED)
+			for(k=0;k<n;k++)
+				buf[k] = px[(int)(x[b+k][0].value)].value;
+		else if(mode == COLUMN_INVERTED)
+			memcpy(buf,&acc[b],sizeof(double)*n);
+		else if(mode != COLUMN_MERGE)
+			for(k=0;k<n;k++)
+				buf[k] = gather(x[b+k]);
+		else
+			for(k=0;k<n;k++)
+				buf[k] = dot(px,x[b+k]);
+
+		kernel_values<KT>(i,b,n,buf,tmp);
+
+		if(SIGNED)
+		{
+			const int y_i = y[i];
+			for(k=0;k<n;k++)
+				data[b+k] = (T)(y_i*y[b+k]*buf[k]);
+		}
+		else
+			for(k=0;k<n;k++)
+				data[b+k] = (T)buf[k];
+	}
+
+	if(mode == COLUMN_DENSE || mode == COLUMN_HASH)
+		unscatter(px);
+}
+
+// data[r] = K(i,r) for r in rows[0,n), in the same way as the
+// contiguous fill
+template<int KT, bool SIGNED>
+void Kernel::kernel_rows_block(int i, const int *rows, int n, Qfloat *data, const schar *y) const
+{
+	const svm_node *px = x[i];
+	int mode = KT == PRECOMPUTED ? COLUMN_MERGE : column_mode(i,0,n);
+
+	if(mode == COLUMN_INVERTED)
+		accumulate(px,rows[0],rows[n-1]+1);
+	else if(mode != COLUMN_MERGE)
+		scatter(px);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && n >= PARALLEL_COLUMN_MIN)
+#endif
+	for(int b=0;b<n;b+=COLUMN_BLOCK)
+	{
+		double buf[COLUMN_BLOCK];
+		double tmp[COLUMN_BLOCK];
+		const int *r = &rows[b];
+		int m = min(n-b,COLUMN_BLOCK);
+		int k;
+
+		if(KT == PRECOMPUTED)
+			for(k=0;k<m;k++)
+				buf[k] = px[(int)(x[r[k]][0].value)].value;
+		else if(mode == COLUMN_INVERTED)
+			for(k=0;k<m;k++)
+				buf[k] = acc[r[k]];
+		else if(mode != COLUMN_MERGE)
+			for(k=0;k<m;k++)
+				buf[k] = gather(x[r[k]]);
+		else
+			for(k=0;k<m;k++)
+				buf[k] = dot(px,x[r[k]]);
+
+		if(KT == RBF)
+		{
+			for(k=0;k<m;k++)
+				tmp[k] = x_square[r[k]];
+			const double xsq_i = x_square[i];
+			for(k=0;k<m;k++)
+				buf[k] = exp_elem(-gamma*(xsq_i+tmp[k]-2*buf[k]));
+		}
+		else
+			kernel_values<KT>(i,0,m,buf,tmp);
+
+		if(SIGNED)
+		{
+			const int y_i = y[i];
+			for(k=0;k<m;k++)
+				data[r[k]] = (Qfloat)(y_i*y[r[k]]*buf[k]);
+		}
+		else
+			for(k=0;k<m;k++)
+				data[r[k]] = (Qfloat)buf[k];
+	}
+
+	if(mode == COLUMN_DENSE || mode == COLUMN_HASH)
+		unscatter(px);
+}
+
+// columns i and j over [start,len) in one pass over the x[k]; only
+// for the dense and merge modes, which are the ones that stream them
+template<int KT, bool SIGNED>
+void Kernel::kernel_pair_block(int i, int j, int start, int len, Qfloat *data_i, Qfloat *data_j, const schar *y) const
+{
+	const svm_node *px = x[i];
+	const svm_node *py = x[j];
+	const bool scattered = KT != PRECOMPUTED && dense != 0;
+
+	if(scattered)
+		scatter_pair(px,py);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && len-start >= PARALLEL_COLUMN_MIN)
+#endif
+	for(int b=start;b<len;b+=COLUMN_BLOCK)
+	{
+		double buf_i[COLUMN_BLOCK];
+		double buf_j[COLUMN_BLOCK];
+		double tmp[COLUMN_BLOCK];
+		int n = min(len-b,COLUMN_BLOCK);
+		int k;
+
+		if(KT == PRECOMPUTED)
+			for(k=0;k<n;k++)
+			{
+				int c = (int)(x[b+k][0].value);
+				buf_i[k] = px[c].value;
+				buf_j[k] = py[c].value;
+			}
+		else if(scattered)
+			for(k=0;k<n;k++)
+				gather_pair(x[b+k],&buf_i[k],&buf_j[k]);
+		else
+			for(k=0;k<n;k++)
+			{
+				buf_i[k] = dot(px,x[b+k]);
+				buf_j[k] = dot(py,x[b+k]);
+			}
+
+		if(KT == RBF)
+		{
+			// both columns share the x_square loads
+			const double xsq_i = x_square[i];
+			const double xsq_j = x_square[j];
+			const double *xsq = &x_square[b];
+			for(k=0;k<n;k++)
+			{
+				buf_i[k] = exp_elem(-gamma*(xsq_i+xsq[k]-2*buf_i[k]));
+				buf_j[k] = exp_elem(-gamma*(xsq_j+xsq[k]-2*buf_j[k]));
+			}
+		}
+		else
+		{
+			kernel_values<KT>(i,b,n,buf_i,tmp);
+			kernel_values<KT>(j,b,n,buf_j,tmp);
+		}
+
+		if(SIGNED)
+		{
+			const int y_i = y[i];
+			const int y_j = y[j];
+			for(k=0;k<n;k++)
+			{
+				data_i[b+k] = (Qfloat)(y_i*y[b+k]*buf_i[k]);
+				data_j[b+k] = (Qfloat)(y_j*y[b+k]*buf_j[k]);
+			}
+		}
+		else
+			for(k=0;k<n;k++)
+			{
+				data_i[b+k] = (Qfloat)buf_i[k];
+				data_j[b+k] = (Qfloat)buf_j[k];
+			}
+	}
+
+	if(scattered)
+		unscatter_pair(px,py);
+}
+
+#define KERNEL_DISPATCH(f, args) \
+	switch(kernel_type) \
+	{ \
+		case LINEAR: \
+			if(y) f<LINEAR,true> args; else f<LINEAR,false> args; \
+			break; \
+		case POLY: \
+			if(y) f<POLY,true> args; else f<POLY,false> args; \
+			break; \
+		case RBF: \
+			if(y) f<RBF,true> args; else f<RBF,false> args; \
+			break; \
+		case SIGMOID: \
+			if(y) f<SIGMOID,true> args; else f<SIGMOID,false> args; \
+			break; \
+		case PRECOMPUTED: \
+			if(y) f<PRECOMPUTED,true> args; else f<PRECOMPUTED,false> args; \
+			break; \
+	}
+
+void Kernel::kernel_column(int i, int start, int len, Qfloat *data, const schar *y) const
+{
+	KERNEL_DISPATCH(kernel_column_block,(i,start,len,data,y))
+}
+
+void Kernel::kernel_column(int i, int start, int len, double *data) const
+{
+	const schar *y = NULL;
+	KERNEL_DISPATCH(kernel_column_block,(i,start,len,data,y))
+}
+
+void Kernel::kernel_rows(int i, const int *rows, int n, Qfloat *data, const schar *y) const
+{
+	KERNEL_DISPATCH(kernel_rows_block,(i,rows,n,data,y))
+}
+
+// taking entries from the cache is worth leaving the contiguous (or
+// paired) fill only if it saves at least 1/HARVEST_MIN of them; and
+// each one is a likely cache miss, which costs more than evaluating
+// the kernel unless instances have HARVEST_NNZ or more features
+#define HARVEST_MIN 8
+#define HARVEST_NNZ 16
+
+void Kernel::fill_column(const Cache *cache, int i, int start, int len, Qfloat *data, const schar *y) const
+{
+	if(avg_nnz < HARVEST_NNZ)
+	{
+		kernel_column(i,start,len,data,y);
+		return;
+	}
+	int n = cache->harvest(i,start,len,data,-1,rows);
+	if(HARVEST_MIN*(len-start-n) < len-start)
+		kernel_column(i,start,len,data,y);
+	else if(n > 0)
+		kernel_rows(i,rows,n,data,y);
+}
+
+void Kernel::fill_rows(const Cache *cache, int i, const int *in, int n, Qfloat *data,
+		       int skip, const schar *y) const
+{
+	if(avg_nnz < HARVEST_NNZ)
+	{
+		kernel_rows(i,in,n,data,y);
+		return;
+	}
+	int m = cache->harvest_rows(i,in,n,data,skip,rows);
+	if(m > 0)
+		kernel_rows(i,rows,m,data,y);
+}
+
+void Kernel::share(SharedCache *cache, const int *index, int l)
+{
+	if(!cache)
+		return;
+	shared = cache;
+	clone(shared_index,index,l);
+	missing = new int[l];
+}
+
+void Kernel::use_file(KernelFile *file_, int l)
+{
+	if(!file_)
+		return;
+	int *index = new int[l];
+	for(int k=0;k<l;k++)
+		if((index[k] = file_->find(x[k])) < 0)
+		{
+			// not an instance of the problem trained on
+			delete[] index;
+			return;
+		}
+	file = file_;
+	file_index = index;
+	if(!missing)
+		missing = new int[l];
+}
+
+bool Kernel::take_shared(const Cache *cache, int i, int start, int len, Qfloat *data,
+			 int skip, const schar *y) const
+{
+	int n = -1;
+	if(shared)
+		n = shared->get_data(i,shared_index,y,start,len,data,missing);
+	if(file && (n < 0 || HARVEST_MIN*(len-start-n) < len-start))
+		n = file->get_data(i,file_index,y,start,len,data,missing);
+	if(n < 0 || HARVEST_MIN*(len-start-n) < len-start)
+		return false;
+	if(n > 0)
+		fill_rows(cache,i,missing,n,data,skip,y);
+	return true;
+}
+
+void Kernel::fill_column2(const Cache *cache, int i, int start_i, Qfloat *data_i,
+			  int j, int start_j, Qfloat *data_j,
+			  int len, const schar *y) const
+{
+	if(avg_nnz < HARVEST_NNZ)
+	{
+		kernel_column2(i,start_i,data_i,j,start_j,data_j,len,y);
+		return;
+	}
+
+	// a column being filled has no valid rows to give; once i is
+	// done, j can take its row from i
+	if(start_i < len)
+	{
+		int n = cache->harvest(i,start_i,len,data_i,start_j < len ? j : -1,rows);
+		if(HARVEST_MIN*(len-start_i-n) >= len-start_i)
+		{
+			if(n > 0)
+				kernel_rows(i,rows,n,data_i,y);
+			if(start_j < len)
+				fill_column(cache,j,start_j,len,data_j,y);
+			return;
+		}
+	}
+	if(start_j < len)
+	{
+		int n = cache->harvest(j,start_j,len,data_j,start_i < len ? i : -1,rows);
+		if(HARVEST_MIN*(len-start_j-n) >= len-start_j)
+		{
+			if(start_i < len)
+				kernel_column(i,start_i,len,data_i,y);
+			if(n > 0)
+				kernel_rows(j,rows,n,data_j,y);
+			return;
+		}
+	}
+
+	// little cached to take, so compute both in one pass
+	kernel_column2(i,start_i,data_i,j,start_j,data_j,len,y);
+}
+
+void Kernel::kernel_column2(int i, int start_i, Qfloat *data_i,
+			    int j, int start_j, Qfloat *data_j,
+			    int len, const schar *y) const
+{
+	// the part only one column misses is filled on its own
+	int start = max(start_i,start_j);
+	if(start_i < start)
+		kernel_column(i,start_i,min(start,len),data_i,y);
+	if(start_j < start)
+		kernel_column(j,start_j,min(start,len),data_j,y);
+	if(start >= len)
+		return;
+
+	int mode;
+	if(kernel_type == PRECOMPUTED)
+		mode = COLUMN_MERGE;
+	else
+	{
+		mode = column_mode(i,start,len);
+		if(column_mode(j,start,len) != mode)
+			mode = COLUMN_HASH;
+	}
+	if(mode == COLUMN_MERGE || mode == COLUMN_DENSE)
+	{
+		KERNEL_DISPATCH(kernel_pair_block,(i,j,start,len,data_i,data_j,y))
+	}
+	else
+	{
+		kernel_column(i,start,len,data_i,y);
+		kernel_column(j,start,len,data_j,y);
+	}
+}
+
+double Kernel::dot(const svm_node *px, const svm_node *py)
+{
+	double sum = 0;
+	while(px->index != -1 && py->index != -1)
+	{
+		if(px->index == py->index)
+		{
+			sum += px->value * py->value;
+			++px;
+			++py;
+		}
+		else
+		{
+			if(px->index > py->index)
+				++py;
+			else
+				++px;
+		}
+	}
+	return sum;
+}
+
+double Kernel::k_function(const svm_node *x, const svm_node *y,
+			  const svm_parameter& param)
+{
+	switch(param.kernel_type)
+	{
+		case LINEAR:
 			return dot(x,y);
 		case POLY:
 			return powi(param.gamma*dot(x,y)+param.coef0,param.degree);
 		case RBF:
 		{
-			double sum = 0;
-			while(x->index != -1 && y->index !=-1)
+			double sum = 0;
+			while(x->index != -1 && y->index !=-1)
+			{
+				if(x->index == y->index)
+				{
+					double d = x->value - y->value;
+					sum += d*d;
+					++x;
+					++y;
+				}
+				else
+				{
+					if(x->index > y->index)
+					{
+						sum += y->value * y->value;
+						++y;
+					}
+					else
+					{
+						sum += x->value * x->value;
+						++x;
+					}
+				}
+			}
+
+			while(x->index != -1)
+			{
+				sum += x->value * x->value;
+				++x;
+			}
+
+			while(y->index != -1)
+			{
+				sum += y->value * y->value;
+				++y;
+			}
+
+			return exp(-param.gamma*sum);
+		}
+		case SIGMOID:
+			return tanh(param.gamma*dot(x,y)+param.coef0);
+		case PRECOMPUTED:  //x: test (validation), y: SV
+			return x[(int)(y->value)].value;
+		default:
+			return 0;  // Unreachable
+	}
+}
+
+//
+// Gradient updates
+//
+// y[k] += a*x[k] (+ b*z[k]) with x, z columns of Q, for the updates of G
+// and G_bar; on x86 the AVX2 or AVX-512 version is picked at run time.
+// They multiply and add separately, as the plain loop does, so that the
+// result does not depend on the machine
+//
+enum { SIMD_NONE, SIMD_AVX2, SIMD_AVX512 };
+
+static int detect_simd_level()
+{
+	int level = SIMD_NONE;
+#ifdef SIMD_DISPATCH
+	__builtin_cpu_init();
+	if(sizeof(Qfloat) == sizeof(float))
+	{
+		if(__builtin_cpu_supports("avx512f"))
+			level = SIMD_AVX512;
+		else if(__builtin_cpu_supports("avx2"))
+			level = SIMD_AVX2;
+	}
+#endif
+	return level;
+}
+
+// the initialization of a local static is done once even when threads
+// of the solvers get here together
+static int simd_level()
+{
+	static const int level = detect_simd_level();
+	return level;
+}
+
+#ifdef SIMD_DISPATCH
+// AVX-512 has FMA, which the compiler must not contract mul and add
+// into. GCC takes that per function; clang, which does not know the
+// optimize attribute, contracts only within an expression and takes the
+// standard pragma, here for the rest of the file
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#define TARGET_AVX512_NO_CONTRACT __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX512_NO_CONTRACT __attribute__((target("avx512f"),optimize("fp-contract=off")))
+#endif
+#endif
+
+static void axpy_plain(double *y, double a, const Qfloat *x, int n)
+{
+	for(int k=0;k<n;k++)
+		y[k] += a*x[k];
+}
+
+static void axpy2_plain(double *y, double a, const Qfloat *x, double b, const Qfloat *z, int n)
+{
+	for(int k=0;k<n;k++)
+		y[k] += x[k]*a + z[k]*b;
+}
+
+#ifdef SIMD_DISPATCH
+__attribute__((target("avx2")))
+static void axpy_avx2(double *y, double a, const Qfloat *x, int n)
+{
+	const float *xf = (const float *)x;
+	__m256d va = _mm256_set1_pd(a);
+	int k = 0;
+	for(;k+4<=n;k+=4)
+	{
+		__m256d vx = _mm256_cvtps_pd(_mm_loadu_ps(xf+k));
+		__m256d vy = _mm256_loadu_pd(y+k);
+		_mm256_storeu_pd(y+k,_mm256_add_pd(vy,_mm256_mul_pd(va,vx)));
+	}
+	for(;k<n;k++)
+		y[k] += a*x[k];
+}
+
+__attribute__((target("avx2")))
+static void axpy2_avx2(double *y, double a, const Qfloat *x, double b, const Qfloat *z, int n)
+{
+	const float *xf = (const float *)x;
+	const float *zf = (const float *)z;
+	__m256d va = _mm256_set1_pd(a);
+	__m256d vb = _mm256_set1_pd(b);
+	int k = 0;
+	for(;k+4<=n;k+=4)
+	{
+		__m256d vx = _mm256_cvtps_pd(_mm_loadu_ps(xf+k));
+		__m256d vz = _mm256_cvtps_pd(_mm_loadu_ps(zf+k));
+		__m256d vy = _mm256_loadu_pd(y+k);
+		__m256d d = _mm256_add_pd(_mm256_mul_pd(vx,va),_mm256_mul_pd(vz,vb));
+		_mm256_storeu_pd(y+k,_mm256_add_pd(vy,d));
+	}
+	for(;k<n;k++)
+		y[k] += x[k]*a + z[k]*b;
+}
+
+// float to double; the unmasked intrinsics trip -Wmaybe-uninitialized
+// in some versions of GCC, so the masked ones are used with all lanes
+__attribute__((target("avx512f")))
+static inline __m512d widen8(__m256 x)
+{
+	return _mm512_maskz_cvtps_pd((__mmask8)0xFF,x);
+}
+
+TARGET_AVX512_NO_CONTRACT
+static void axpy_avx512(double *y, double a, const Qfloat *x, int n)
+{
+	const float *xf = (const float *)x;
+	__m512d va = _mm512_set1_pd(a);
+	int k = 0;
+	for(;k+8<=n;k+=8)
+	{
+		__m512d vx = widen8(_mm256_loadu_ps(xf+k));
+		__m512d vy = _mm512_loadu_pd(y+k);
+		_mm512_storeu_pd(y+k,_mm512_add_pd(vy,_mm512_mul_pd(va,vx)));
+	}
+	for(;k<n;k++)
+		y[k] += a*x[k];
+}
+
+TARGET_AVX512_NO_CONTRACT
+static void axpy2_avx512(double *y, double a, const Qfloat *x, double b, const Qfloat *z, int n)
+{
+	const float *xf = (const float *)x;
+	const float *zf = (const float *)z;
+	__m512d va = _mm512_set1_pd(a);
+	__m512d vb = _mm512_set1_pd(b);
+	int k = 0;
+	for(;k+8<=n;k+=8)
+	{
+		__m512d vx = widen8(_mm256_loadu_ps(xf+k));
+		__m512d vz = widen8(_mm256_loadu_ps(zf+k));
+		__m512d vy = _mm512_loadu_pd(y+k);
+		__m512d d = _mm512_add_pd(_mm512_mul_pd(vx,va),_mm512_mul_pd(vz,vb));
+		_mm512_storeu_pd(y+k,_mm512_add_pd(vy,d));
+	}
+	for(;k<n;k++)
+		y[k] += x[k]*a + z[k]*b;
+}
+#endif
+
+// long updates are split over threads in chunks of this many entries
+#define PARALLEL_UPDATE_MIN 32768
+
+// y[k] += a*x[k] for k in [0,n), on the calling thread
+static void axpy_block(double *y, double a, const Qfloat *x, int n)
+{
+#ifdef SIMD_DISPATCH
+	int level = simd_level();
+	if(level == SIMD_AVX512)
+		axpy_avx512(y,a,x,n);
+	else if(level == SIMD_AVX2)
+		axpy_avx2(y,a,x,n);
+	else
+#endif
+		axpy_plain(y,a,x,n);
+}
+
+// y[k] += a*x[k] for k in [0,n)
+static void axpy(double *y, double a, const Qfloat *x, int n, int nr_thread)
+{
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && n >= 2*PARALLEL_UPDATE_MIN)
+#endif
+	for(int c=0;c<n;c+=PARALLEL_UPDATE_MIN)
+		axpy_block(y+c,a,x+c,min(n-c,PARALLEL_UPDATE_MIN));
+}
+
+// y[k] += x[k]*a + z[k]*b for k in [0,n), on the calling thread
+static void axpy2_block(double *y, double a, const Qfloat *x, double b, const Qfloat *z, int n)
+{
+#ifdef SIMD_DISPATCH
+	int level = simd_level();
+	if(level == SIMD_AVX512)
+		axpy2_avx512(y,a,x,b,z,n);
+	else if(level == SIMD_AVX2)
+		axpy2_avx2(y,a,x,b,z,n);
+	else
+#endif
+		axpy2_plain(y,a,x,b,z,n);
+}
+
+// y[k] += x[k]*a + z[k]*b for k in [0,n)
+static void axpy2(double *y, double a, const Qfloat *x, double b, const Qfloat *z, int n, int nr_thread)
+{
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && n >= 2*PARALLEL_UPDATE_MIN)
+#endif
+	for(int c=0;c<n;c+=PARALLEL_UPDATE_MIN)
+		axpy2_block(y+c,a,x+c,b,z+c,min(n-c,PARALLEL_UPDATE_MIN));
+}
+
+//
+// Maxima for working set selection
+//
+// max_value(v,n) is the largest of v[0,n) and last_index(v,n,m) the
+// last position of m in it; unlike tracking the position along with
+// the maximum, finding the maximum alone vectorizes
+//
+static double max_value_plain(const double *v, int n)
+{
+	double m = -INF;
+	for(int k=0;k<n;k++)
+		if(v[k] > m)
+			m = v[k];
+	return m;
+}
+
+#ifdef SIMD_DISPATCH
+__attribute__((target("avx2")))
+static double max_value_avx2(const double *v, int n)
+{
+	__m256d vm = _mm256_set1_pd(-INF);
+	int k = 0;
+	for(;k+4<=n;k+=4)
+		vm = _mm256_max_pd(vm,_mm256_loadu_pd(v+k));
+	double t[4];
+	_mm256_storeu_pd(t,vm);
+	double m = max(max(t[0],t[1]),max(t[2],t[3]));
+	for(;k<n;k++)
+		if(v[k] > m)
+			m = v[k];
+	return m;
+}
+
+__attribute__((target("avx512f")))
+static double max_value_avx512(const double *v, int n)
+{
+	__m512d vm = _mm512_set1_pd(-INF);
+	int k = 0;
+	for(;k+8<=n;k+=8)
+		vm = _mm512_maskz_max_pd((__mmask8)0xFF,vm,_mm512_loadu_pd(v+k));
+	double t[8];
+	_mm512_storeu_pd(t,vm);
+	double m = -INF;
+	for(int q=0;q<8;q++)
+		m = max(m,t[q]);
+	for(;k<n;k++)
+		if(v[k] > m)
+			m = v[k];
+	return m;
+}
+#endif
+
+static double max_value(const double *v, int n)
+{
+#ifdef SIMD_DISPATCH
+	int level = simd_level();
+	if(level == SIMD_AVX512)
+		return max_value_avx512(v,n);
+	else if(level == SIMD_AVX2)
+		return max_value_avx2(v,n);
+#endif
+	return max_value_plain(v,n);
+}
+
+static inline int last_index(const double *v, int n, double m)
+{
+	int k = n-1;
+	while(v[k] != m)
+		--k;
+	return k;
+}
+
+// c ? a : b, selected in the integer domain so that loops using it
+// can be vectorized
+static inline double select_value(bool c, double a, double b)
+{
+	long long ia, ib, mask = -(long long)c;
+	memcpy(&ia,&a,sizeof(ia));
+	memcpy(&ib,&b,sizeof(ib));
+	ia = (ia & mask) | (ib & ~mask);
+	memcpy(&a,&ia,sizeof(a));
+	return a;
+}
+
+// v[k] = -obj_diff of the candidates for j, -INF for the others, given
+// u[k] = y_t*G[t] for t in I_low and -INF elsewhere, and s[k] = y_t;
+// QD_i+QD[t]-y_t*(2*y_i*Q_i[t]) is exactly what the separate cases for
+// y_t = +1 and -1 compute.  With SSE2 only, the compiler does not
+// vectorize this, so it is built for AVX2 and AVX-512 too
+static inline void obj_values_body(double *v, const double *u, const double *s,
+	const Qfloat *Q_i, const double *QD, double QD_i, double y_i, double Gmax, int n)
+{
+	for(int k=0;k<n;k++)
+	{
+		double grad_diff = Gmax+u[k];	// -INF where u is
+		double quad_coef = QD_i+QD[k]-s[k]*(y_i*Q_i[k]);
+		quad_coef = select_value(quad_coef > 0,quad_coef,TAU);
+		v[k] = select_value(grad_diff > 0,(grad_diff*grad_diff)/quad_coef,-INF);
+	}
+}
+
+#ifdef SIMD_DISPATCH
+__attribute__((target("avx2")))
+static void obj_values_avx2(double *v, const double *u, const double *s,
+	const Qfloat *Q_i, const double *QD, double QD_i, double y_i, double Gmax, int n)
+{
+	obj_values_body(v,u,s,Q_i,QD,QD_i,y_i,Gmax,n);
+}
+
+TARGET_AVX512_NO_CONTRACT
+static void obj_values_avx512(double *v, const double *u, const double *s,
+	const Qfloat *Q_i, const double *QD, double QD_i, double y_i, double Gmax, int n)
+{
+	obj_values_body(v,u,s,Q_i,QD,QD_i,y_i,Gmax,n);
+}
+#endif
+
+static void obj_values(double *v, const double *u, const double *s,
+	const Qfloat *Q_i, const double *QD, double QD_i, double y_i, double Gmax, int n)
+{
+#ifdef SIMD_DISPATCH
+	int level = simd_level();
+	if(level == SIMD_AVX512)
+		obj_values_avx512(v,u,s,Q_i,QD,QD_i,y_i,Gmax,n);
+	else if(level == SIMD_AVX2)
+		obj_values_avx2(v,u,s,Q_i,QD,QD_i,y_i,Gmax,n);
+	else
+#endif
+		obj_values_body(v,u,s,Q_i,QD,QD_i,y_i,Gmax,n);
+}
+
+// working set selection goes over the active set in chunks, on several
+// threads if there are many; each chunk keeps the last of its best, and
+// chunks are merged in order, so that the result is that of one pass
+#define SELECT_CHUNK 16384
+// within a chunk, candidates are computed this many at a time
+#define SELECT_BLOCK 256
+
+// a column is prefetched during the update of G if the active set has
+// this many entries, PREFETCH_BLOCK entries between checks for the end
+#define PREFETCH_MIN 4096
+#define PREFETCH_BLOCK 256
+
+// block mode updates G in tiles of this many entries
+#define BLOCK_UPDATE_TILE 4096
+
+//
+// The two-variable subproblem: minimize over alpha_i and alpha_j with
+// the others fixed, clipped to the box and the equality constraint
+//
+static void update_pair(double &alpha_i, double &alpha_j, schar y_i, schar y_j,
+			double C_i, double C_j, double QD_i, double QD_j,
+			double Q_ij, double G_i, double G_j)
+{
+	if(y_i!=y_j)
+	{
+		double quad_coef = QD_i+QD_j+2*Q_ij;
+		if (quad_coef <= 0)
+			quad_coef = TAU;
+		double delta = (-G_i-G_j)/quad_coef;
+		double diff = alpha_i - alpha_j;
+		alpha_i += delta;
+		alpha_j += delta;
+
+		if(diff > 0)
+		{
+			if(alpha_j < 0)
 			{
-				if(x->index == y->index)
-				{
-					double d = x->value - y->value;
-					sum += d*d;
-					++x;
-					++y;
-				}
-				else
-				{
-					if(x->index > y->index)
-					{
-						sum += y->value * y->value;
-						++y;
-					}
-					else
-					{
-						sum += x->value * x->value;
-						++x;
-					}
-				}
+				alpha_j = 0;
+				alpha_i = diff;
 			}
-
-			while(x->index != -1)
+		}
+		else
+		{
+			if(alpha_i < 0)
 			{
-				sum += x->value * x->value;
-				++x;
+				alpha_i = 0;
+				alpha_j = -diff;
 			}
-
-			while(y->index != -1)
+		}
+		if(diff > C_i - C_j)
+		{
+			if(alpha_i > C_i)
 			{
-				sum += y->value * y->value;
-				++y;
+				alpha_i = C_i;
+				alpha_j = C_i - diff;
+			}
+		}
+		else
+		{
+			if(alpha_j > C_j)
+			{
+				alpha_j = C_j;
+				alpha_i = C_j + diff;
+			}
+		}
+	}
+	else
+	{
+		double quad_coef = QD_i+QD_j-2*Q_ij;
+		if (quad_coef <= 0)
+			quad_coef = TAU;
+		double delta = (G_i-G_j)/quad_coef;
+		double sum = alpha_i + alpha_j;
+		alpha_i -= delta;
+		alpha_j += delta;
+
+		if(sum > C_i)
+		{
+			if(alpha_i > C_i)
+			{
+				alpha_i = C_i;
+				alpha_j = sum - C_i;
+			}
+		}
+		else
+		{
+			if(alpha_j < 0)
+			{
+				alpha_j = 0;
+				alpha_i = sum;
+			}
+		}
+		if(sum > C_j)
+		{
+			if(alpha_j > C_j)
+			{
+				alpha_j = C_j;
+				alpha_i = sum - C_j;
+			}
+		}
+		else
+		{
+			if(alpha_i < 0)
+			{
+				alpha_i = 0;
+				alpha_j = sum;
 			}
-
-			return exp(-param.gamma*sum);
 		}
-		case SIGMOID:
-			return tanh(param.gamma*dot(x,y)+param.coef0);
-		case PRECOMPUTED:  //x: test (validation), y: SV
-			return x[(int)(y->value)].value;
-		default:
-			return 0;  // Unreachable
 	}
 }
 
@@ -390,6 +2651,110 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 //
 // solution will be put in \alpha, objective value will be put in obj
 //
+class Checkpoint;
+
+// a subproblem in a checkpoint: its result or, if unfinished, the
+// solver state, with the arrays in the original order of the variables
+enum { CHECKPOINT_NONE, CHECKPOINT_RESULT, CHECKPOINT_STATE };
+struct checkpoint_record
+{
+	int kind;
+	int l;
+	double obj, rho, upper_bound_p, upper_bound_n, r;	// result
+	int active_size, iter, unshrink, counter;	// state
+	int *active_set;	// state: the variable at each position
+	double *alpha;		// result and state
+	double *G, *G_bar;	// state
+};
+
+//
+// Workspace: the buffers of the solvers, kept from one subproblem to the
+// next. A buffer grows only when a larger subproblem comes, so once the
+// largest was seen, solving allocates nothing. Each slot is used by one
+// piece of code at a time; a nested training takes the same slots only
+// after the outer one has given them back.
+//
+class Workspace
+{
+public:
+	enum {
+		SOLVER_P, SOLVER_Y, SOLVER_ALPHA, SOLVER_ALPHA_STATUS,
+		SOLVER_ACTIVE_SET, SOLVER_G, SOLVER_G_BAR, SOLVER_SELECT,
+		SOLVER_PREFETCH, SOLVER_BLOCK, SOLVER_IN_BLOCK, SOLVER_QB,
+		SOLVER_QBB, SOLVER_BLOCK_BUF, SOLVER_INDEX, SOLVER_VALUE,
+		FORM_ALPHA, FORM_LINEAR, FORM_Y,
+		NR_SLOT
+	};
+	Workspace();
+	~Workspace();
+	template<class T> T *get(int slot, size_t n)
+	{
+		return (T *)get_bytes(slot,sizeof(T)*n);
+	}
+	void report() const;
+private:
+	void *buf[NR_SLOT];
+	size_t size[NR_SLOT];
+	long int nr_get, nr_alloc;
+	void *get_bytes(int slot, size_t n);
+};
+
+Workspace::Workspace()
+{
+	for(int k=0;k<NR_SLOT;k++)
+	{
+		buf[k] = NULL;
+		size[k] = 0;
+	}
+	nr_get = nr_alloc = 0;
+}
+
+Workspace::~Workspace()
+{
+	for(int k=0;k<NR_SLOT;k++)
+		free(buf[k]);
+}
+
+void *Workspace::get_bytes(int slot, size_t n)
+{
+	++nr_get;
+	if(n > size[slot])
+	{
+		free(buf[slot]);
+		buf[slot] = malloc(n);
+		size[slot] = n;
+		++nr_alloc;
+	}
+	return buf[slot];
+}
+
+void Workspace::report() const
+{
+	size_t total = 0;
+	for(int k=0;k<NR_SLOT;k++)
+		total += size[k];
+	info("workspace: %ld buffers taken, %ld allocations, %.1f MB\n",
+	     nr_get,nr_alloc,(double)total/(1<<20));
+}
+
+// what the subproblems of one svm_train call share
+struct train_context
+{
+	double deadline;	// from max_time, 0 for no limit
+	Checkpoint *checkpoint;	// NULL if not saving
+	int subproblem;		// the number of the solve in the checkpoint
+	Workspace *workspace;
+
+	// the instance of each variable in kernel_cache, which is shared
+	// with other problems or NULL if unused
+	SharedCache *kernel_cache;
+	const int *kernel_index;
+	KernelFile *kernel_file;	// NULL if unused
+	// the start of C-SVC, or alpha-alpha* of epsilon-SVR; NULL for 0
+	const double *initial_alpha;
+	unsigned long long *random_state;	// NULL to draw from rand()
+};
+
 class Solver {
 public:
 	Solver() {};
@@ -405,7 +2770,8 @@ public:
 
 	void Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		   double *alpha_, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking);
+		   SolutionInfo* si, int shrinking, int nr_thread,
+		   int working_set_size, int max_iter, train_context *ctx);
 protected:
 	int active_size;
 	schar *y;
@@ -422,6 +2788,42 @@ protected:
 	double *G_bar;		// gradient, if we treat free variables as 0
 	int l;
 	bool unshrink;	// XXX
+	int nr_thread;	// for the gradient updates and working set selection
+	Workspace *workspace;	// where the arrays above and below live
+
+	// per chunk results of working set selection; [0] is for y = +1,
+	// [1] for y = -1, and the plain solver uses only [0]
+	struct select_result {
+		double Gmax[2];
+		int Gmax_idx[2];
+		double Gmax2[2];
+		double obj;	// -obj_diff, the decrease of the objective
+		int obj_idx;
+		double Gnext;	// plain solver: the best of the other blocks
+		int Gnext_idx;
+	};
+	select_result *select_chunk;
+
+	// shrinking counts and times, and the state of shrinking = 2
+	int nr_shrink, nr_shrunk, nr_unshrink;
+	double shrink_time, unshrink_time;
+	int shrink_interval;
+	double shrink_gain, shrink_mark;
+	long int shrink_hit, shrink_miss;
+
+	// the runner-up for i in the last selection, whose column is
+	// computed by one thread while the others update G
+	int next_i;
+	Qfloat *prefetch_buf;
+
+	// block mode: the working set, its columns over the active set and
+	// the subproblem's matrix, only allocated if working_set_size > 2
+	int working_set_size;
+	int *block;
+	char *in_block;
+	Qfloat *QB;
+	double *QBB;
+	double *block_buf;
 
 	double get_C(int i)
 	{
@@ -440,13 +2842,296 @@ protected:
 	bool is_free(int i) { return alpha_status[i] == FREE; }
 	void swap_index(int i, int j);
 	void reconstruct_gradient();
+	void restore_state(const checkpoint_record *r);
+	void save_state(Checkpoint *checkpoint, int k, int iter, int counter, bool write);
+	void shrink();
+	int adaptive_shrinking(int interval);
 	virtual int select_working_set(int &i, int &j);
+	void update_prefetch(double a, const Qfloat *Q_i, double b, const Qfloat *Q_j, int k, int n);
+	int select_block(int i, int j);
+	void update_block(int i, int j);
+	int select_chunks() const { return (active_size+SELECT_CHUNK-1)/SELECT_CHUNK; }
+	void select_i(int begin, int end, select_result *r) const;
+	void select_j(int begin, int end, int i, const Qfloat *Q_i, double Gmax, select_result *r) const;
 	virtual double calculate_rho();
+	virtual double calculate_gap(double rho) { return duality_gap(rho,0); }
+	double duality_gap(double rho, double r) const;
 	virtual void do_shrinking();
 private:
 	bool be_shrunk(int i, double Gmax1, double Gmax2);
 };
 
+//
+// Checkpoint of an svm_train call, for svm_train_resume: a record per
+// subproblem, numbered as train_context says. The records are
+// written to the file every interval seconds, through a temporary file
+// so a crash while writing leaves the old one. A hash of the problem
+// and the parameters keeps the checkpoint of another training from
+// being resumed. The gradient is kept as it is, shrunk or not, so
+// resuming needs no reconstruction. Solvers running at the same time
+// use it within critical(checkpoint) sections.
+//
+class Checkpoint
+{
+public:
+	Checkpoint(const char *file_name, double interval, unsigned long long hash);
+	~Checkpoint();
+	bool load();
+	// write the records if a subproblem is unfinished, or else remove
+	// the file, as the training is done
+	void finish();
+	bool due() const { return wall_time() >= last_save + interval; }
+	void save();
+
+	bool get_result(int k, int l, double *alpha, Solver::SolutionInfo *si) const;
+	const checkpoint_record *get_state(int k, int l) const;
+	void add_result(int k, int l, const double *alpha, const Solver::SolutionInfo *si);
+	// make record k a state of l variables, for the caller to fill in
+	checkpoint_record *set_state(int k, int l);
+private:
+	char *file_name;
+	double interval;
+	unsigned long long hash;
+	double last_save;
+	int nr_record;
+	checkpoint_record *record;
+	checkpoint_record *get_record(int k, int l, int kind);
+	void clear();
+};
+
+static const char checkpoint_magic[8] = {'L','S','V','M','C','K','P','2'};
+
+template <class T> static bool read_values(FILE *fp, T *v, int n)
+{
+	return fread(v,sizeof(T),(size_t)n,fp) == (size_t)n;
+}
+
+template <class T> static void write_values(FILE *fp, const T *v, int n)
+{
+	fwrite(v,sizeof(T),(size_t)n,fp);
+}
+
+Checkpoint::Checkpoint(const char *file_name_, double interval_, unsigned long long hash_)
+:interval(interval_),hash(hash_)
+{
+	file_name = Malloc(char,strlen(file_name_)+1);
+	strcpy(file_name,file_name_);
+	last_save = wall_time();
+	nr_record = 0;
+	record = NULL;
+}
+
+Checkpoint::~Checkpoint()
+{
+	clear();
+	free(file_name);
+}
+
+void Checkpoint::clear()
+{
+	for(int k=0;k<nr_record;k++)
+	{
+		free(record[k].active_set);
+		free(record[k].alpha);
+		free(record[k].G);
+		free(record[k].G_bar);
+	}
+	free(record);
+	record = NULL;
+	nr_record = 0;
+}
+
+// record k, emptied and with room for its kind
+checkpoint_record *Checkpoint::get_record(int k, int l, int kind)
+{
+	if(k >= nr_record)
+	{
+		record = (checkpoint_record *)realloc(record,sizeof(checkpoint_record)*(k+1));
+		memset(record+nr_record,0,sizeof(checkpoint_record)*(k+1-nr_record));
+		nr_record = k+1;
+	}
+	checkpoint_record *r = &record[k];
+	free(r->active_set);
+	free(r->G);
+	free(r->G_bar);
+	r->active_set = NULL;
+	r->G = r->G_bar = NULL;
+	r->alpha = (double *)realloc(r->alpha,sizeof(double)*l);
+	if(kind == CHECKPOINT_STATE)
+	{
+		r->active_set = Malloc(int,l);
+		r->G = Malloc(double,l);
+		r->G_bar = Malloc(double,l);
+	}
+	r->kind = kind;
+	r->l = l;
+	return r;
+}
+
+bool Checkpoint::get_result(int k, int l, double *alpha, Solver::SolutionInfo *si) const
+{
+	if(k >= nr_record || record[k].kind != CHECKPOINT_RESULT || record[k].l != l)
+		return false;
+	const checkpoint_record *r = &record[k];
+	memcpy(alpha,r->alpha,sizeof(double)*l);
+	si->obj = r->obj;
+	si->rho = r->rho;
+	si->upper_bound_p = r->upper_bound_p;
+	si->upper_bound_n = r->upper_bound_n;
+	si->r = r->r;
+	return true;
+}
+
+const checkpoint_record *Checkpoint::get_state(int k, int l) const
+{
+	if(k >= nr_record || record[k].kind != CHECKPOINT_STATE || record[k].l != l)
+		return NULL;
+	return &record[k];
+}
+
+void Checkpoint::add_result(int k, int l, const double *alpha, const Solver::SolutionInfo *si)
+{
+	checkpoint_record *r = get_record(k,l,CHECKPOINT_RESULT);
+	memcpy(r->alpha,alpha,sizeof(double)*l);
+	r->obj = si->obj;
+	r->rho = si->rho;
+	r->upper_bound_p = si->upper_bound_p;
+	r->upper_bound_n = si->upper_bound_n;
+	r->r = si->r;
+	if(due())
+		save();
+}
+
+checkpoint_record *Checkpoint::set_state(int k, int l)
+{
+	return get_record(k,l,CHECKPOINT_STATE);
+}
+
+void Checkpoint::save()
+{
+	char *tmp_name = Malloc(char,strlen(file_name)+5);
+	sprintf(tmp_name,"%s.tmp",file_name);
+	FILE *fp = fopen(tmp_name,"wb");
+	if(fp == NULL)
+	{
+		fprintf(stderr,"WARNING: cannot write checkpoint %s\n",tmp_name);
+		free(tmp_name);
+		last_save = wall_time();
+		return;
+	}
+
+	write_values(fp,checkpoint_magic,8);
+	write_values(fp,&hash,1);
+	write_values(fp,&nr_record,1);
+	for(int k=0;k<nr_record;k++)
+	{
+		const checkpoint_record *r = &record[k];
+		int kind = r->kind;
+		write_values(fp,&kind,1);
+		write_values(fp,&r->l,1);
+		if(kind == CHECKPOINT_RESULT)
+		{
+			double v[5] = {r->obj, r->rho, r->upper_bound_p, r->upper_bound_n, r->r};
+			write_values(fp,v,5);
+			write_values(fp,r->alpha,r->l);
+		}
+		else if(kind == CHECKPOINT_STATE)
+		{
+			int v[4] = {r->active_size, r->iter, r->unshrink, r->counter};
+			write_values(fp,v,4);
+			write_values(fp,r->active_set,r->l);
+			write_values(fp,r->alpha,r->l);
+			write_values(fp,r->G,r->l);
+			write_values(fp,r->G_bar,r->l);
+		}
+	}
+
+	bool ok = !ferror(fp);
+	if(fclose(fp) != 0)
+		ok = false;
+#ifdef _WIN32
+	if(ok)
+		remove(file_name);	// rename does not replace files there
+#endif
+	if(!ok || rename(tmp_name,file_name) != 0)
+		fprintf(stderr,"WARNING: cannot write checkpoint %s\n",file_name);
+	free(tmp_name);
+	last_save = wall_time();
+}
+
+bool Checkpoint::load()
+{
+	FILE *fp = fopen(file_name,"rb");
+	if(fp == NULL)
+		return false;
+
+	char magic[8];
+	unsigned long long h;
+	int n = 0;
+	bool ours = read_values(fp,magic,8) && memcmp(magic,checkpoint_magic,8) == 0 &&
+		    read_values(fp,&h,1) && h == hash;
+	bool ok = ours && read_values(fp,&n,1) && n >= 0;
+	for(int k=0;ok && k<n;k++)
+	{
+		// subproblems not reached are written as empty records, as
+		// get_record leaves them
+		int kind, l;
+		ok = read_values(fp,&kind,1) && read_values(fp,&l,1) &&
+		     (kind == CHECKPOINT_NONE ? l == 0 : l > 0);
+		if(!ok)
+			break;
+		if(kind == CHECKPOINT_RESULT)
+		{
+			double v[5];
+			checkpoint_record *r = get_record(k,l,kind);
+			ok = read_values(fp,v,5) && read_values(fp,r->alpha,l);
+			r->obj = v[0];
+			r->rho = v[1];
+			r->upper_bound_p = v[2];
+			r->upper_bound_n = v[3];
+			r->r = v[4];
+		}
+		else if(kind == CHECKPOINT_STATE)
+		{
+			int v[4];
+			checkpoint_record *r = get_record(k,l,kind);
+			ok = read_values(fp,v,4) && v[0] >= 0 && v[0] <= l && v[3] > 0 &&
+			     read_values(fp,r->active_set,l) && read_values(fp,r->alpha,l) &&
+			     read_values(fp,r->G,l) && read_values(fp,r->G_bar,l);
+			r->active_size = v[0];
+			r->iter = v[1];
+			r->unshrink = v[2];
+			r->counter = v[3];
+			for(int i=0;ok && i<l;i++)
+				ok = r->active_set[i] >= 0 && r->active_set[i] < l;
+		}
+		else
+			ok = kind == CHECKPOINT_NONE;
+	}
+	fclose(fp);
+
+	if(!ok)
+	{
+		clear();
+		if(ours)
+			info("checkpoint %s is damaged, training from the start\n",file_name);
+		else
+			info("checkpoint %s is not of this training\n",file_name);
+	}
+	return ok;
+}
+
+void Checkpoint::finish()
+{
+	for(int k=0;k<nr_record;k++)
+		if(record[k].kind == CHECKPOINT_STATE)
+		{
+			save();
+			return;
+		}
+	remove(file_name);
+}
+
 void Solver::swap_index(int i, int j)
 {
 	Q->swap_index(i,j);
@@ -465,6 +3150,7 @@ void Solver::reconstruct_gradient()
 
 	if(active_size == l) return;
 
+	double start_time = wall_time();
 	int i,j;
 	int nr_free = 0;
 
@@ -480,12 +3166,25 @@ void Solver::reconstruct_gradient()
 
 	if (nr_free*l > 2*active_size*(l-active_size))
 	{
+		// the sums must go in the order of j, so list the free ones
+		// once instead of testing each of them per column
+		int *free_set = workspace->get<int>(Workspace::SOLVER_INDEX,nr_free);
+		double *free_alpha = workspace->get<double>(Workspace::SOLVER_VALUE,nr_free);
+		int k = 0;
+		for(j=0;j<active_size;j++)
+			if(is_free(j))
+			{
+				free_set[k] = j;
+				free_alpha[k] = alpha[j];
+				k++;
+			}
 		for(i=active_size;i<l;i++)
 		{
 			const Qfloat *Q_i = Q->get_Q(i,active_size);
-			for(j=0;j<active_size;j++)
-				if(is_free(j))
-					G[i] += alpha[j] * Q_i[j];
+			double sum = G[i];
+			for(k=0;k<nr_free;k++)
+				sum += free_alpha[k] * Q_i[free_set[k]];
+			G[i] = sum;
 		}
 	}
 	else
@@ -494,23 +3193,154 @@ void Solver::reconstruct_gradient()
 			if(is_free(i))
 			{
 				const Qfloat *Q_i = Q->get_Q(i,l);
-				double alpha_i = alpha[i];
-				for(j=active_size;j<l;j++)
-					G[j] += alpha_i * Q_i[j];
+				axpy(G+active_size,alpha[i],Q_i+active_size,l-active_size,nr_thread);
 			}
 	}
+
+	nr_unshrink++;
+	unshrink_time += wall_time() - start_time;
+}
+
+// continue from a checkpointed state: take alpha and the gradient, and
+// put each variable where it was
+void Solver::restore_state(const checkpoint_record *r)
+{
+	int i;
+	memcpy(alpha,r->alpha,sizeof(double)*l);
+	memcpy(G,r->G,sizeof(double)*l);
+	memcpy(G_bar,r->G_bar,sizeof(double)*l);
+	for(i=0;i<l;i++)
+		update_alpha_status(i);
+
+	int *pos = workspace->get<int>(Workspace::SOLVER_INDEX,l);	// where each variable is now
+	for(i=0;i<l;i++)
+		pos[i] = i;
+	for(i=0;i<l;i++)
+	{
+		int j = pos[r->active_set[i]];
+		if(j != i)
+		{
+			swap_index(i,j);
+			pos[active_set[i]] = i;
+			pos[active_set[j]] = j;
+		}
+	}
+	active_size = r->active_size;
+	unshrink = r->unshrink != 0;
+}
+
+// keep the state as record k of the checkpoint, and write it if asked;
+// counter is what the shrinking countdown is to resume at the top of
+// the loop, so the resumed solver shrinks where this one would have
+void Solver::save_state(Checkpoint *checkpoint, int k, int iter, int counter, bool write)
+{
+	checkpoint_record *r = checkpoint->set_state(k,l);
+	r->active_size = active_size;
+	r->iter = iter;
+	r->unshrink = unshrink;
+	r->counter = counter;
+	for(int i=0;i<l;i++)
+	{
+		int t = active_set[i];
+		r->active_set[i] = t;
+		r->alpha[t] = alpha[i];
+		r->G[t] = G[i];
+		r->G_bar[t] = G_bar[i];
+	}
+	if(write)
+		checkpoint->save();
+}
+
+// do_shrinking, counting the calls, the variables removed and the time,
+// less that of reconstructing the gradient
+void Solver::shrink()
+{
+	double start_time = wall_time();
+	double old_unshrink_time = unshrink_time;
+	int old_nr_unshrink = nr_unshrink;
+	int old_active_size = active_size;
+
+	do_shrinking();
+
+	if(nr_unshrink != old_nr_unshrink)
+		old_active_size = l;
+	nr_shrink++;
+	nr_shrunk += old_active_size - active_size;
+	shrink_time += wall_time() - start_time - (unshrink_time - old_unshrink_time);
+}
+
+// shrinking = 2: an interval run on the active set is taken to save its
+// time times (l-active_size)/active_size, and shrinking and
+// reconstructing the gradient are the cost; once reconstructing has
+// happened and the cost exceeds the savings, shrinking is skipped.
+// Otherwise it is done more often while it removes many variables or
+// while most columns are missed in the cache, as then the shorter
+// columns save the most, and less often while it removes few; returns
+// the iterations until the next check
+int Solver::adaptive_shrinking(int interval)
+{
+	long int hit, miss;
+	double now = wall_time();
+	shrink_gain += (now - shrink_mark)*(l - active_size)/active_size;
+	Q->cache_counts(&hit,&miss);
+	long int nr_hit = hit - shrink_hit, nr_miss = miss - shrink_miss;
+	shrink_hit = hit;
+	shrink_miss = miss;
+
+	if(nr_unshrink > 0 && shrink_time + unshrink_time > shrink_gain)
+		shrink_interval = min(2*shrink_interval,16*interval);
+	else
+	{
+		int old_nr_shrunk = nr_shrunk;
+		int old_active_size = active_size;
+		shrink();
+		int removed = nr_shrunk - old_nr_shrunk;
+		if(20*removed >= old_active_size || nr_miss > nr_hit)
+			shrink_interval = max(shrink_interval/2,interval/8);
+		else if(100*removed < old_active_size)
+			shrink_interval = min(2*shrink_interval,16*interval);
+	}
+	shrink_mark = wall_time();
+	return max(shrink_interval,1);
 }
 
 void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		   double *alpha_, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking)
+		   SolutionInfo* si, int shrinking, int nr_thread,
+		   int working_set_size, int max_iter, train_context *ctx)
 {
+	// a subproblem solved before the checkpoint was saved
+	Checkpoint *checkpoint = ctx->checkpoint;
+	int subproblem = ctx->subproblem;
+	bool solved = false;
+	if(checkpoint)
+	{
+#ifdef _OPENMP
+#pragma omp critical(checkpoint)
+#endif
+		solved = checkpoint->get_result(subproblem,l,alpha_,si);
+	}
+	if(solved)
+	{
+		info("optimization restored from checkpoint\n");
+		return;
+	}
+
 	this->l = l;
+#ifdef _OPENMP
+	this->nr_thread = nr_thread > 0 ? nr_thread : omp_get_max_threads();
+#else
+	this->nr_thread = 1;
+#endif
 	this->Q = &Q;
 	QD=Q.get_QD();
-	clone(p, p_,l);
-	clone(y, y_,l);
-	clone(alpha,alpha_,l);
+	workspace = ctx->workspace;
+	p = workspace->get<double>(Workspace::SOLVER_P,l);
+	y = workspace->get<schar>(Workspace::SOLVER_Y,l);
+	alpha = workspace->get<double>(Workspace::SOLVER_ALPHA,l);
+	memcpy(p,p_,sizeof(double)*l);
+	memcpy(y,y_,sizeof(schar)*l);
+	memcpy(alpha,alpha_,sizeof(double)*l);
 	this->Cp = Cp;
 	this->Cn = Cn;
 	this->eps = eps;
@@ -518,23 +3348,64 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 
 	// initialize alpha_status
 	{
-		alpha_status = new char[l];
+		alpha_status = workspace->get<char>(Workspace::SOLVER_ALPHA_STATUS,l);
 		for(int i=0;i<l;i++)
 			update_alpha_status(i);
 	}
 
+	select_chunk = workspace->get<select_result>(Workspace::SOLVER_SELECT,(l+SELECT_CHUNK-1)/SELECT_CHUNK);
+	next_i = -1;
+	prefetch_buf = this->nr_thread > 1 ? workspace->get<Qfloat>(Workspace::SOLVER_PREFETCH,l) : NULL;
+
+	this->working_set_size = min(working_set_size,l);
+	if(this->working_set_size > 2)
+	{
+		int q = this->working_set_size;
+		block = workspace->get<int>(Workspace::SOLVER_BLOCK,3*q);
+		in_block = workspace->get<char>(Workspace::SOLVER_IN_BLOCK,l);
+		memset(in_block,0,sizeof(char)*(size_t)l);
+		QB = workspace->get<Qfloat>(Workspace::SOLVER_QB,(size_t)q*l);
+		QBB = workspace->get<double>(Workspace::SOLVER_QBB,q*q);
+		block_buf = workspace->get<double>(Workspace::SOLVER_BLOCK_BUF,4*q);
+	}
+
 	// initialize active set (for shrinking)
 	{
-		active_set = new int[l];
+		active_set = workspace->get<int>(Workspace::SOLVER_ACTIVE_SET,l);
 		for(int i=0;i<l;i++)
 			active_set[i] = i;
 		active_size = l;
 	}
 
-	// initialize gradient
+	// initialize gradient, or take it from the checkpoint
+	int iter = 0;
+	bool timeout = false;
+	int counter = min(l,1000)+1;
+	bool resumed = false;
+	G = workspace->get<double>(Workspace::SOLVER_G,l);
+	G_bar = workspace->get<double>(Workspace::SOLVER_G_BAR,l);
+	if(checkpoint)
+	{
+#ifdef _OPENMP
+#pragma omp critical(checkpoint)
+#endif
+		{
+			const checkpoint_record *saved = checkpoint->get_state(subproblem,l);
+			if(saved)
+			{
+				restore_state(saved);
+				iter = saved->iter;
+				counter = saved->counter;
+				resumed = true;
+			}
+		}
+	}
+	if(resumed)
+	{
+		info("optimization resumed from checkpoint at #iter = %d\n",iter);
+	}
+	else
 	{
-		G = new double[l];
-		G_bar = new double[l];
 		int i;
 		for(i=0;i<l;i++)
 		{
@@ -545,30 +3416,49 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			if(!is_lower_bound(i))
 			{
 				const Qfloat *Q_i = Q.get_Q(i,l);
-				double alpha_i = alpha[i];
-				int j;
-				for(j=0;j<l;j++)
-					G[j] += alpha_i*Q_i[j];
+				axpy(G,alpha[i],Q_i,l,this->nr_thread);
 				if(is_upper_bound(i))
-					for(j=0;j<l;j++)
-						G_bar[j] += get_C(i) * Q_i[j];
+					axpy(G_bar,get_C(i),Q_i,l,this->nr_thread);
 			}
 	}
 
 	// optimization step
 
-	int iter = 0;
-	int max_iter = max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
-	int counter = min(l,1000)+1;
+	if(max_iter <= 0)
+		max_iter = max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
+
+	nr_shrink = nr_shrunk = nr_unshrink = 0;
+	shrink_time = unshrink_time = 0;
+	shrink_interval = min(l,1000);
+	shrink_gain = 0;
+	shrink_mark = wall_time();
+	Q.cache_counts(&shrink_hit,&shrink_miss);
 
 	while(iter < max_iter)
 	{
+		if(ctx->deadline > 0 && wall_time() >= ctx->deadline)
+		{
+			timeout = true;
+			break;
+		}
+
 		// show progress and do shrinking
 
 		if(--counter == 0)
 		{
 			counter = min(l,1000);
-			if(shrinking) do_shrinking();
+			if(shrinking == 2)
+				counter = adaptive_shrinking(counter);
+			else if(shrinking)
+				shrink();
+			if(checkpoint)
+			{
+#ifdef _OPENMP
+#pragma omp critical(checkpoint)
+#endif
+				if(checkpoint->due())
+					save_state(checkpoint,subproblem,iter,counter+1,true);
+			}
 			info(".");
 		}
 
@@ -588,10 +3478,16 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 
 		++iter;
 
+		if(this->working_set_size > 2)
+		{
+			update_block(i,j);
+			continue;
+		}
+
 		// update alpha[i] and alpha[j], handle bounds carefully
 
-		const Qfloat *Q_i = Q.get_Q(i,active_size);
-		const Qfloat *Q_j = Q.get_Q(j,active_size);
+		Qfloat *Q_i, *Q_j;
+		Q.get_Q2(i,j,active_size,&Q_i,&Q_j);
 
 		double C_i = get_C(i);
 		double C_j = get_C(j);
@@ -599,102 +3495,19 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		double old_alpha_i = alpha[i];
 		double old_alpha_j = alpha[j];
 
-		if(y[i]!=y[j])
-		{
-			double quad_coef = QD[i]+QD[j]+2*Q_i[j];
-			if (quad_coef <= 0)
-				quad_coef = TAU;
-			double delta = (-G[i]-G[j])/quad_coef;
-			double diff = alpha[i] - alpha[j];
-			alpha[i] += delta;
-			alpha[j] += delta;
-
-			if(diff > 0)
-			{
-				if(alpha[j] < 0)
-				{
-					alpha[j] = 0;
-					alpha[i] = diff;
-				}
-			}
-			else
-			{
-				if(alpha[i] < 0)
-				{
-					alpha[i] = 0;
-					alpha[j] = -diff;
-				}
-			}
-			if(diff > C_i - C_j)
-			{
-				if(alpha[i] > C_i)
-				{
-					alpha[i] = C_i;
-					alpha[j] = C_i - diff;
-				}
-			}
-			else
-			{
-				if(alpha[j] > C_j)
-				{
-					alpha[j] = C_j;
-					alpha[i] = C_j + diff;
-				}
-			}
-		}
-		else
-		{
-			double quad_coef = QD[i]+QD[j]-2*Q_i[j];
-			if (quad_coef <= 0)
-				quad_coef = TAU;
-			double delta = (G[i]-G[j])/quad_coef;
-			double sum = alpha[i] + alpha[j];
-			alpha[i] -= delta;
-			alpha[j] += delta;
-
-			if(sum > C_i)
-			{
-				if(alpha[i] > C_i)
-				{
-					alpha[i] = C_i;
-					alpha[j] = sum - C_i;
-				}
-			}
-			else
-			{
-				if(alpha[j] < 0)
-				{
-					alpha[j] = 0;
-					alpha[i] = sum;
-				}
-			}
-			if(sum > C_j)
-			{
-				if(alpha[j] > C_j)
-				{
-					alpha[j] = C_j;
-					alpha[i] = sum - C_j;
-				}
-			}
-			else
-			{
-				if(alpha[i] < 0)
-				{
-					alpha[i] = 0;
-					alpha[j] = sum;
-				}
-			}
-		}
+		update_pair(alpha[i],alpha[j],y[i],y[j],C_i,C_j,QD[i],QD[j],Q_i[j],G[i],G[j]);
 
 		// update G
 
 		double delta_alpha_i = alpha[i] - old_alpha_i;
 		double delta_alpha_j = alpha[j] - old_alpha_j;
 
-		for(int k=0;k<active_size;k++)
-		{
-			G[k] += Q_i[k]*delta_alpha_i + Q_j[k]*delta_alpha_j;
-		}
+		int k = next_i, n;
+		if(prefetch_buf && k != -1 && k != i && k != j &&
+		   active_size >= PREFETCH_MIN && (n = Q.prefetch_len(k,active_size)) > 0)
+			update_prefetch(delta_alpha_i,Q_i,delta_alpha_j,Q_j,k,n);
+		else
+			axpy2(G,delta_alpha_i,Q_i,delta_alpha_j,Q_j,active_size,this->nr_thread);
 
 		// update alpha_status and G_bar
 
@@ -703,32 +3516,22 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			bool uj = is_upper_bound(j);
 			update_alpha_status(i);
 			update_alpha_status(j);
-			int k;
+			// G_bar -= C*Q_i is the same as G_bar += (-C)*Q_i, bit for bit
 			if(ui != is_upper_bound(i))
 			{
 				Q_i = Q.get_Q(i,l);
-				if(ui)
-					for(k=0;k<l;k++)
-						G_bar[k] -= C_i * Q_i[k];
-				else
-					for(k=0;k<l;k++)
-						G_bar[k] += C_i * Q_i[k];
+				axpy(G_bar,ui ? -C_i : C_i,Q_i,l,this->nr_thread);
 			}
 
 			if(uj != is_upper_bound(j))
 			{
 				Q_j = Q.get_Q(j,l);
-				if(uj)
-					for(k=0;k<l;k++)
-						G_bar[k] -= C_j * Q_j[k];
-				else
-					for(k=0;k<l;k++)
-						G_bar[k] += C_j * Q_j[k];
+				axpy(G_bar,uj ? -C_j : C_j,Q_j,l,this->nr_thread);
 			}
 		}
 	}
 
-	if(iter >= max_iter)
+	if(iter >= max_iter || timeout)
 	{
 		if(active_size < l)
 		{
@@ -737,13 +3540,29 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			active_size = l;
 			info("*");
 		}
-		fprintf(stderr,"\nWARNING: reaching max number of iterations\n");
+		if(timeout)
+			fprintf(stderr,"\nWARNING: reaching time limit\n");
+		else
+			fprintf(stderr,"\nWARNING: reaching max number of iterations\n");
 	}
 
 	// calculate rho
 
 	si->rho = calculate_rho();
 
+	if(iter >= max_iter || timeout)
+	{
+		fprintf(stderr,"WARNING: stopped with duality gap %g\n",calculate_gap(si->rho));
+		// keep the state, so a resumed training goes on from here
+		if(checkpoint)
+		{
+#ifdef _OPENMP
+#pragma omp critical(checkpoint)
+#endif
+			save_state(checkpoint,subproblem,iter,counter,false);
+		}
+	}
+
 	// calculate objective value
 	{
 		double v = 0;
@@ -771,15 +3590,250 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 	si->upper_bound_p = Cp;
 	si->upper_bound_n = Cn;
 
+	if(checkpoint && iter < max_iter && !timeout)
+	{
+#ifdef _OPENMP
+#pragma omp critical(checkpoint)
+#endif
+		checkpoint->add_result(subproblem,l,alpha_,si);
+	}
+
 	info("\noptimization finished, #iter = %d\n",iter);
+	if(shrinking)
+	{
+		long int hit, miss;
+		Q.cache_counts(&hit,&miss);
+		info("#shrink = %d (%d removed, %.3fs), #unshrink = %d (%.3fs), cache hit rate = %.1f%%\n",
+		     nr_shrink,nr_shrunk,shrink_time,nr_unshrink,unshrink_time,
+		     hit+miss > 0 ? 100.0*(double)hit/(double)(hit+miss) : 0.0);
+	}
+}
+
+// G += a*Q_i + b*Q_j on all threads but one, which meanwhile computes
+// column k, PREFETCH_BLOCK entries at a time, until the others are done;
+// the part it got goes into the cache once nobody reads Q_i and Q_j
+void Solver::update_prefetch(double a, const Qfloat *Q_i, double b, const Qfloat *Q_j, int k, int n)
+{
+#ifdef _OPENMP
+	int len = active_size;
+	int nr_done = 0;
+	int m = 0;
+#pragma omp parallel num_threads(nr_thread)
+	{
+		int t = omp_get_thread_num();
+		int T = omp_get_num_threads();
+		if(T == 1)
+			axpy2_block(G,a,Q_i,b,Q_j,len);
+		else if(t == T-1)
+		{
+			for(;m<n;m+=PREFETCH_BLOCK)
+			{
+				int done;
+#pragma omp atomic read
+				done = nr_done;
+				if(done == T-1)
+					break;
+				Q->compute_Q(k,m,min(n,m+PREFETCH_BLOCK),prefetch_buf);
+			}
+			m = min(m,n);
+		}
+		else
+		{
+			int begin = (int)((long int)len*t/(T-1));
+			int end = (int)((long int)len*(t+1)/(T-1));
+			axpy2_block(G+begin,a,Q_i+begin,b,Q_j+begin,end-begin);
+#pragma omp atomic update
+			nr_done++;
+		}
+	}
+	if(m > 0)
+		Q->store_Q(k,m,prefetch_buf);
+#else
+	axpy2(G,a,Q_i,b,Q_j,active_size,1);
+#endif
+}
+
+// block mode: the working set is (i,j) from select_working_set and
+// then the largest violators, alternately from I_up by -y_t*G[t] and
+// from I_low by y_t*G[t]; returns its size
+int Solver::select_block(int i, int j)
+{
+	int q = min(working_set_size,active_size);
+	// the q best of each side, kept in decreasing order
+	double *up_v = block_buf, *low_v = block_buf+q;
+	int *up_idx = block+q, *low_idx = block+2*q;
+	int nr_up = 0, nr_low = 0;
+	int t,k;
+
+	for(t=0;t<active_size;t++)
+	{
+		if(t == i || t == j)
+			continue;
+		double v;
+		if(alpha_status[t] != (y[t] > 0 ? UPPER_BOUND : LOWER_BOUND))
+		{
+			v = -y[t]*G[t];
+			if(nr_up < q || v > up_v[nr_up-1])
+			{
+				k = min(nr_up,q-1);
+				for(;k>0 && up_v[k-1] < v;k--)
+				{
+					up_v[k] = up_v[k-1];
+					up_idx[k] = up_idx[k-1];
+				}
+				up_v[k] = v;
+				up_idx[k] = t;
+				nr_up = min(nr_up+1,q);
+			}
+		}
+		if(alpha_status[t] != (y[t] > 0 ? LOWER_BOUND : UPPER_BOUND))
+		{
+			v = y[t]*G[t];
+			if(nr_low < q || v > low_v[nr_low-1])
+			{
+				k = min(nr_low,q-1);
+				for(;k>0 && low_v[k-1] < v;k--)
+				{
+					low_v[k] = low_v[k-1];
+					low_idx[k] = low_idx[k-1];
+				}
+				low_v[k] = v;
+				low_idx[k] = t;
+				nr_low = min(nr_low+1,q);
+			}
+		}
+	}
+
+	int n = 0;
+	block[n++] = i;
+	block[n++] = j;
+	in_block[i] = in_block[j] = 1;
+	int u = 0, w = 0;
+	while(n < q && (u < nr_up || w < nr_low))
+	{
+		if(u < nr_up && !in_block[up_idx[u]])
+		{
+			block[n++] = up_idx[u];
+			in_block[up_idx[u]] = 1;
+		}
+		u++;
+		if(n < q && w < nr_low && !in_block[low_idx[w]])
+		{
+			block[n++] = low_idx[w];
+			in_block[low_idx[w]] = 1;
+		}
+		w++;
+	}
+	for(k=0;k<n;k++)
+		in_block[block[k]] = 0;
+
+	return n;
+}
+
+// block mode: solve the subproblem over the working set by the pairwise
+// method on local copies, then update G by all the changed columns in
+// one pass over the active set
+void Solver::update_block(int i, int j)
+{
+	int n = select_block(i,j);
+	int k,m;
+
+	for(k=0;k<n;k++)
+		memcpy(QB+(size_t)k*active_size,Q->get_Q(block[k],active_size),sizeof(Qfloat)*(size_t)active_size);
+	for(k=0;k<n;k++)
+		for(m=0;m<n;m++)
+			QBB[k*n+m] = QB[(size_t)k*active_size+block[m]];
+
+	double *a = block_buf;
+	double *g = block_buf+n;
+	double *C = block_buf+2*n;
+	double *d = block_buf+3*n;
+	for(k=0;k<n;k++)
+	{
+		a[k] = alpha[block[k]];
+		g[k] = G[block[k]];
+		C[k] = get_C(block[k]);
+	}
+
+	// WSS 2 as in select_working_set, over the working set only
+	int max_inner = 100*n;
+	for(int inner=0;inner<max_inner;inner++)
+	{
+		double Gmax = -INF, Gmax2 = -INF, obj_diff_min = INF;
+		int s = -1, r = -1;
+		for(k=0;k<n;k++)
+		{
+			schar y_k = y[block[k]];
+			if(y_k > 0 ? a[k] < C[k] : a[k] > 0)
+				if(-y_k*g[k] >= Gmax)
+				{
+					Gmax = -y_k*g[k];
+					s = k;
+				}
+		}
+		if(s == -1)
+			break;
+		const double *Q_s = QBB+s*n;
+		schar y_s = y[block[s]];
+		for(k=0;k<n;k++)
+		{
+			schar y_k = y[block[k]];
+			if(y_k > 0 ? a[k] > 0 : a[k] < C[k])
+			{
+				double grad_diff = Gmax+y_k*g[k];
+				if(y_k*g[k] >= Gmax2)
+					Gmax2 = y_k*g[k];
+				if(grad_diff > 0)
+				{
+					double quad_coef = QD[block[s]]+QD[block[k]]-2.0*y_s*y_k*Q_s[k];
+					double obj_diff = -(grad_diff*grad_diff)/(quad_coef > 0 ? quad_coef : TAU);
+					if(obj_diff <= obj_diff_min)
+					{
+						r = k;
+						obj_diff_min = obj_diff;
+					}
+				}
+			}
+		}
+		if(Gmax+Gmax2 < eps || r == -1)
+			break;
+
+		double old_a_s = a[s], old_a_r = a[r];
+		update_pair(a[s],a[r],y_s,y[block[r]],C[s],C[r],
+			    QD[block[s]],QD[block[r]],Q_s[r],g[s],g[r]);
+		double delta_s = a[s]-old_a_s, delta_r = a[r]-old_a_r;
+		const double *Q_r = QBB+r*n;
+		for(k=0;k<n;k++)
+			g[k] += Q_s[k]*delta_s + Q_r[k]*delta_r;
+	}
 
-	delete[] p;
-	delete[] y;
-	delete[] alpha;
-	delete[] alpha_status;
-	delete[] active_set;
-	delete[] G;
-	delete[] G_bar;
+	// update G; each tile of G takes all the changed columns while it
+	// is in cache
+	for(k=0;k<n;k++)
+		d[k] = a[k]-alpha[block[k]];
+	int len = active_size;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && len >= 2*PARALLEL_UPDATE_MIN)
+#endif
+	for(int t=0;t<len;t+=BLOCK_UPDATE_TILE)
+	{
+		int m = min(len-t,BLOCK_UPDATE_TILE);
+		for(int c=0;c<n;c++)
+			if(d[c] != 0)
+				axpy_block(G+t,d[c],QB+(size_t)c*len+t,m);
+	}
+
+	// update alpha_status and G_bar
+	for(k=0;k<n;k++)
+		if(d[k] != 0)
+		{
+			int t = block[k];
+			bool u = is_upper_bound(t);
+			alpha[t] = a[k];
+			update_alpha_status(t);
+			if(u != is_upper_bound(t))
+				axpy(G_bar,u ? -C[k] : C[k],Q->get_Q(t,l),l,nr_thread);
+		}
 }
 
 // return 1 if already optimal, return 0 otherwise
@@ -795,82 +3849,64 @@ int Solver::select_working_set(int &out_i, int &out_j)
 	double Gmax2 = -INF;
 	int Gmax_idx = -1;
 	int Gmin_idx = -1;
-	double obj_diff_min = INF;
+	double obj_diff_min = -INF;	// negated
+	int nr_chunk = select_chunks();
+	int c;
 
-	for(int t=0;t<active_size;t++)
-		if(y[t]==+1)
-		{
-			if(!is_upper_bound(t))
-				if(-G[t] >= Gmax)
-				{
-					Gmax = -G[t];
-					Gmax_idx = t;
-				}
-		}
-		else
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && nr_chunk > 1)
+#endif
+	for(c=0;c<nr_chunk;c++)
+		select_i(c*SELECT_CHUNK,min(active_size,(c+1)*SELECT_CHUNK),&select_chunk[c]);
+	for(c=0;c<nr_chunk;c++)
+		if(select_chunk[c].Gmax_idx[0] != -1 && select_chunk[c].Gmax[0] >= Gmax)
 		{
-			if(!is_lower_bound(t))
-				if(G[t] >= Gmax)
-				{
-					Gmax = G[t];
-					Gmax_idx = t;
-				}
+			Gmax = select_chunk[c].Gmax[0];
+			Gmax_idx = select_chunk[c].Gmax_idx[0];
 		}
 
 	int i = Gmax_idx;
-	const Qfloat *Q_i = NULL;
-	if(i != -1) // NULL Q_i not accessed: Gmax=-INF if i=-1
-		Q_i = Q->get_Q(i,active_size);
+	if(i == -1)	// then no j has grad_diff > 0
+		return 1;
 
-	for(int j=0;j<active_size;j++)
+	if(prefetch_buf)
 	{
-		if(y[j]==+1)
+		// the runner-up is the best of the other blocks or the second
+		// best in the block of i
+		double Gnext = -INF;
+		next_i = -1;
+		for(c=0;c<nr_chunk;c++)
 		{
-			if (!is_lower_bound(j))
+			const select_result &r = select_chunk[c];
+			int t = r.Gmax_idx[0] == i ? r.Gnext_idx : r.Gmax_idx[0];
+			if(t != -1 && -y[t]*G[t] >= Gnext)
 			{
-				double grad_diff=Gmax+G[j];
-				if (G[j] >= Gmax2)
-					Gmax2 = G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff;
-					double quad_coef = QD[i]+QD[j]-2.0*y[i]*Q_i[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
+				Gnext = -y[t]*G[t];
+				next_i = t;
 			}
 		}
-		else
-		{
-			if (!is_upper_bound(j))
+		int b = i/SELECT_BLOCK*SELECT_BLOCK;
+		for(int t=b;t<min(active_size,b+SELECT_BLOCK);t++)
+			if(t != i && alpha_status[t] != (y[t] > 0 ? UPPER_BOUND : LOWER_BOUND) && -y[t]*G[t] >= Gnext)
 			{
-				double grad_diff= Gmax-G[j];
-				if (-G[j] >= Gmax2)
-					Gmax2 = -G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff;
-					double quad_coef = QD[i]+QD[j]+2.0*y[i]*Q_i[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
+				Gnext = -y[t]*G[t];
+				next_i = t;
 			}
+	}
+	const Qfloat *Q_i = Q->get_Q(i,active_size);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && nr_chunk > 1)
+#endif
+	for(c=0;c<nr_chunk;c++)
+		select_j(c*SELECT_CHUNK,min(active_size,(c+1)*SELECT_CHUNK),i,Q_i,Gmax,&select_chunk[c]);
+	for(c=0;c<nr_chunk;c++)
+	{
+		Gmax2 = max(Gmax2,select_chunk[c].Gmax2[0]);
+		if(select_chunk[c].obj_idx != -1 && select_chunk[c].obj >= obj_diff_min)
+		{
+			Gmin_idx = select_chunk[c].obj_idx;
+			obj_diff_min = select_chunk[c].obj;
 		}
 	}
 
@@ -882,6 +3918,72 @@ int Solver::select_working_set(int &out_i, int &out_j)
 	return 0;
 }
 
+// the candidates for i in [begin,end): -y_t*G[t] for t in I_up
+void Solver::select_i(int begin, int end, select_result *r) const
+{
+	double v[SELECT_BLOCK];
+	r->Gmax[0] = r->Gnext = -INF;
+	r->Gmax_idx[0] = r->Gnext_idx = -1;
+	for(int b=begin;b<end;b+=SELECT_BLOCK)
+	{
+		int n = min(end-b,SELECT_BLOCK);
+		for(int k=0;k<n;k++)
+		{
+			int t = b+k;
+			bool up = alpha_status[t] != (y[t] > 0 ? UPPER_BOUND : LOWER_BOUND);
+			v[k] = select_value(up,-y[t]*G[t],-INF);
+		}
+		double m = max_value(v,n);
+		if(m != -INF && m >= r->Gmax[0])
+		{
+			r->Gnext = r->Gmax[0];
+			r->Gnext_idx = r->Gmax_idx[0];
+			r->Gmax[0] = m;
+			r->Gmax_idx[0] = b+last_index(v,n,m);
+		}
+		else if(m != -INF && m >= r->Gnext)
+		{
+			r->Gnext = m;
+			r->Gnext_idx = b+last_index(v,n,m);
+		}
+	}
+}
+
+// the candidates for j in [begin,end): Gmax2 over I_low, and -obj_diff
+// for t in I_low with grad_diff > 0; -(a*a)/q == -((a*a)/q), so taking
+// the last largest -obj_diff is taking the last smallest obj_diff
+void Solver::select_j(int begin, int end, int i, const Qfloat *Q_i, double Gmax, select_result *r) const
+{
+	double u[SELECT_BLOCK];
+	double v[SELECT_BLOCK];
+	double s[SELECT_BLOCK];
+	const double QD_i = QD[i];
+	const double y_i = 2.0*y[i];
+	r->Gmax2[0] = -INF;
+	r->obj = -INF;
+	r->obj_idx = -1;
+	for(int b=begin;b<end;b+=SELECT_BLOCK)
+	{
+		int n = min(end-b,SELECT_BLOCK);
+		int k;
+		for(k=0;k<n;k++)
+		{
+			int t = b+k;
+			bool low = alpha_status[t] != (y[t] > 0 ? LOWER_BOUND : UPPER_BOUND);
+			u[k] = select_value(low,y[t]*G[t],-INF);
+			s[k] = y[t];
+		}
+		obj_values(v,u,s,&Q_i[b],&QD[b],QD_i,y_i,Gmax,n);
+		r->Gmax2[0] = max(r->Gmax2[0],max_value(u,n));
+		double m = max_value(v,n);
+		if(m != -INF && m >= r->obj)
+		{
+			r->obj = m;
+			r->obj_idx = b+last_index(v,n,m);
+		}
+	}
+}
+
 bool Solver::be_shrunk(int i, double Gmax1, double Gmax2)
 {
 	if(is_upper_bound(i))
@@ -963,6 +4065,23 @@ void Solver::do_shrinking()
 		}
 }
 
+// an upper bound on f(alpha) - min f over the feasible set: with the
+// multipliers y_i*rho + r of the equality constraints, and d_i =
+// G[i] - y_i*rho - r, it is sum of alpha_i*d_i - C_i*min(0,d_i);
+// G must be whole
+double Solver::duality_gap(double rho, double r) const
+{
+	double gap = 0;
+	for(int i=0;i<l;i++)
+	{
+		double d = G[i] - y[i]*rho - r;
+		gap += alpha[i]*d;
+		if(d < 0)
+			gap -= (y[i] > 0 ? Cp : Cn)*d;
+	}
+	return gap;
+}
+
 double Solver::calculate_rho()
 {
 	double r;
@@ -1012,15 +4131,22 @@ public:
 	Solver_NU() {}
 	void Solve(int l, const QMatrix& Q, const double *p, const schar *y,
 		   double *alpha, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking)
+		   SolutionInfo* si, int shrinking, int nr_thread,
+		   int max_iter, train_context *ctx)
 	{
 		this->si = si;
-		Solver::Solve(l,Q,p,y,alpha,Cp,Cn,eps,si,shrinking);
+		// the block mode does not keep the extra constraint
+		Solver::Solve(l,Q,p,y,alpha,Cp,Cn,eps,si,shrinking,nr_thread,2,
+			      max_iter,ctx);
 	}
 private:
 	SolutionInfo *si;
 	int select_working_set(int &i, int &j);
+	void select_i(int begin, int end, select_result *r) const;
+	void select_j(int begin, int end, int ip, const Qfloat *Q_ip, double Gmaxp,
+		      int in, const Qfloat *Q_in, double Gmaxn, select_result *r) const;
 	double calculate_rho();
+	double calculate_gap(double rho) { return duality_gap(rho,si->r); }
 	bool be_shrunk(int i, double Gmax1, double Gmax2, double Gmax3, double Gmax4);
 	void do_shrinking();
 };
@@ -1043,86 +4169,58 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 	int Gmaxn_idx = -1;
 
 	int Gmin_idx = -1;
-	double obj_diff_min = INF;
+	double obj_diff_min = -INF;	// negated
+	int nr_chunk = select_chunks();
+	int c;
 
-	for(int t=0;t<active_size;t++)
-		if(y[t]==+1)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && nr_chunk > 1)
+#endif
+	for(c=0;c<nr_chunk;c++)
+		select_i(c*SELECT_CHUNK,min(active_size,(c+1)*SELECT_CHUNK),&select_chunk[c]);
+	for(c=0;c<nr_chunk;c++)
+	{
+		const select_result *r = &select_chunk[c];
+		if(r->Gmax_idx[0] != -1 && r->Gmax[0] >= Gmaxp)
 		{
-			if(!is_upper_bound(t))
-				if(-G[t] >= Gmaxp)
-				{
-					Gmaxp = -G[t];
-					Gmaxp_idx = t;
-				}
+			Gmaxp = r->Gmax[0];
+			Gmaxp_idx = r->Gmax_idx[0];
 		}
-		else
+		if(r->Gmax_idx[1] != -1 && r->Gmax[1] >= Gmaxn)
 		{
-			if(!is_lower_bound(t))
-				if(G[t] >= Gmaxn)
-				{
-					Gmaxn = G[t];
-					Gmaxn_idx = t;
-				}
+			Gmaxn = r->Gmax[1];
+			Gmaxn_idx = r->Gmax_idx[1];
 		}
+	}
 
 	int ip = Gmaxp_idx;
 	int in = Gmaxn_idx;
-	const Qfloat *Q_ip = NULL;
-	const Qfloat *Q_in = NULL;
-	if(ip != -1) // NULL Q_ip not accessed: Gmaxp=-INF if ip=-1
+	if(ip == -1 && in == -1)	// then no j has grad_diff > 0
+		return 1;
+	Qfloat *Q_ip = NULL;
+	Qfloat *Q_in = NULL;
+	if(ip != -1 && in != -1)
+		Q->get_Q2(ip,in,active_size,&Q_ip,&Q_in);
+	else if(ip != -1) // NULL Q_ip not accessed: Gmaxp=-INF if ip=-1
 		Q_ip = Q->get_Q(ip,active_size);
-	if(in != -1)
+	else
 		Q_in = Q->get_Q(in,active_size);
 
-	for(int j=0;j<active_size;j++)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nr_thread) schedule(static) if(nr_thread > 1 && nr_chunk > 1)
+#endif
+	for(c=0;c<nr_chunk;c++)
+		select_j(c*SELECT_CHUNK,min(active_size,(c+1)*SELECT_CHUNK),
+			 ip,Q_ip,Gmaxp,in,Q_in,Gmaxn,&select_chunk[c]);
+	for(c=0;c<nr_chunk;c++)
 	{
-		if(y[j]==+1)
-		{
-			if (!is_lower_bound(j))
-			{
-				double grad_diff=Gmaxp+G[j];
-				if (G[j] >= Gmaxp2)
-					Gmaxp2 = G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff;
-					double quad_coef = QD[ip]+QD[j]-2*Q_ip[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
-			}
-		}
-		else
+		const select_result *r = &select_chunk[c];
+		Gmaxp2 = max(Gmaxp2,r->Gmax2[0]);
+		Gmaxn2 = max(Gmaxn2,r->Gmax2[1]);
+		if(r->obj_idx != -1 && r->obj >= obj_diff_min)
 		{
-			if (!is_upper_bound(j))
-			{
-				double grad_diff=Gmaxn-G[j];
-				if (-G[j] >= Gmaxn2)
-					Gmaxn2 = -G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff;
-					double quad_coef = QD[in]+QD[j]-2*Q_in[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
-			}
+			Gmin_idx = r->obj_idx;
+			obj_diff_min = r->obj;
 		}
 	}
 
@@ -1138,6 +4236,95 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 	return 0;
 }
 
+// as in Solver, but with the maxima for y = +1 and -1 kept apart
+void Solver_NU::select_i(int begin, int end, select_result *r) const
+{
+	double vp[SELECT_BLOCK];
+	double vn[SELECT_BLOCK];
+	for(int q=0;q<2;q++)
+	{
+		r->Gmax[q] = -INF;
+		r->Gmax_idx[q] = -1;
+	}
+	for(int b=begin;b<end;b+=SELECT_BLOCK)
+	{
+		int n = min(end-b,SELECT_BLOCK);
+		for(int k=0;k<n;k++)
+		{
+			int t = b+k;
+			bool up = alpha_status[t] != (y[t] > 0 ? UPPER_BOUND : LOWER_BOUND);
+			double v = select_value(up,-y[t]*G[t],-INF);
+			vp[k] = select_value(y[t] > 0,v,-INF);
+			vn[k] = select_value(y[t] > 0,-INF,v);
+		}
+		double m = max_value(vp,n);
+		if(m != -INF && m >= r->Gmax[0])
+		{
+			r->Gmax[0] = m;
+			r->Gmax_idx[0] = b+last_index(vp,n,m);
+		}
+		m = max_value(vn,n);
+		if(m != -INF && m >= r->Gmax[1])
+		{
+			r->Gmax[1] = m;
+			r->Gmax_idx[1] = b+last_index(vn,n,m);
+		}
+	}
+}
+
+// each of the two groups goes through obj_values with its own i; a
+// j is a candidate in at most one, so the larger value is the one
+void Solver_NU::select_j(int begin, int end, int ip, const Qfloat *Q_ip, double Gmaxp,
+			 int in, const Qfloat *Q_in, double Gmaxn, select_result *r) const
+{
+	double up[SELECT_BLOCK];
+	double un[SELECT_BLOCK];
+	double vp[SELECT_BLOCK];
+	double vn[SELECT_BLOCK];
+	double one[SELECT_BLOCK];
+	int k;
+	for(k=0;k<SELECT_BLOCK;k++)
+		one[k] = 1;
+	r->Gmax2[0] = r->Gmax2[1] = -INF;
+	r->obj = -INF;
+	r->obj_idx = -1;
+	for(int b=begin;b<end;b+=SELECT_BLOCK)
+	{
+		int n = min(end-b,SELECT_BLOCK);
+		for(k=0;k<n;k++)
+		{
+			int t = b+k;
+			bool low = alpha_status[t] != (y[t] > 0 ? LOWER_BOUND : UPPER_BOUND);
+			double u = select_value(low,y[t]*G[t],-INF);
+			up[k] = select_value(y[t] > 0,u,-INF);
+			un[k] = select_value(y[t] > 0,-INF,u);
+		}
+		r->Gmax2[0] = max(r->Gmax2[0],max_value(up,n));
+		r->Gmax2[1] = max(r->Gmax2[1],max_value(un,n));
+
+		// QD[i]+QD[j]-2*Q_i[j], with 2*Q_i[j] exact in either type
+		if(ip != -1)
+			obj_values(vp,up,one,&Q_ip[b],&QD[b],QD[ip],2.0,Gmaxp,n);
+		else
+			for(k=0;k<n;k++)
+				vp[k] = -INF;
+		if(in != -1)
+			obj_values(vn,un,one,&Q_in[b],&QD[b],QD[in],2.0,Gmaxn,n);
+		else
+			for(k=0;k<n;k++)
+				vn[k] = -INF;
+		for(k=0;k<n;k++)
+			vp[k] = max(vp[k],vn[k]);
+
+		double m = max_value(vp,n);
+		if(m != -INF && m >= r->obj)
+		{
+			r->obj = m;
+			r->obj_idx = b+last_index(vp,n,m);
+		}
+	}
+}
+
 bool Solver_NU::be_shrunk(int i, double Gmax1, double Gmax2, double Gmax3, double Gmax4)
 {
 	if(is_upper_bound(i))
@@ -1260,34 +4447,125 @@ double Solver_NU::calculate_rho()
 	return (r1-r2)/2;
 }
 
+//
+// A problem as the solvers take it, over the instances of another
+// without copying them: variable k is x[index[k]], or x[k] if index is
+// NULL; its label is y[k] or, if y is NULL, +1 for k < nr_positive and
+// -1 for the others, as the one-against-one pairs take them
+//
+struct problem_view
+{
+	int l;
+	svm_node * const *x;
+	const int *index;
+	const double *y;
+	int nr_positive;
+
+	problem_view(const svm_problem *prob)
+	:l(prob->l), x(prob->x), index(NULL), y(prob->y), nr_positive(0) {}
+	problem_view(int l_, svm_node * const *x_, const int *index_, int nr_positive_)
+	:l(l_), x(x_), index(index_), y(NULL), nr_positive(nr_positive_) {}
+
+	svm_node *node(int k) const { return x[index ? index[k] : k]; }
+	double label(int k) const
+	{
+		if(y)
+			return y[k];
+		return k < nr_positive ? +1 : -1;
+	}
+};
+
 //
 // Q matrices for various formulations
 //
 class SVC_Q: public Kernel
 {
 public:
-	SVC_Q(const svm_problem& prob, const svm_parameter& param, const schar *y_)
-	:Kernel(prob.l, prob.x, param)
+	SVC_Q(const problem_view& prob, const svm_parameter& param, const schar *y_,
+	      const train_context *ctx)
+	:Kernel(prob.l, prob.x, prob.index, param)
 	{
+		l = prob.l;
 		clone(y,y_,prob.l);
-		cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)));
+		cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)),(long int)(param.spill_size*(1<<20)));
 		QD = new double[prob.l];
 		for(int i=0;i<prob.l;i++)
 			QD[i] = (this->*kernel_function)(i,i);
+		share(ctx->kernel_cache,ctx->kernel_index,prob.l);
+		use_file(ctx->kernel_file,prob.l);
 	}
 
 	Qfloat *get_Q(int i, int len) const
 	{
 		Qfloat *data;
-		int start, j;
+		int start;
 		if((start = cache->get_data(i,&data,len)) < len)
 		{
-			for(j=start;j<len;j++)
-				data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
+			if(!(sharing() && take_shared(cache,i,start,len,data,-1,y)))
+				fill_column(cache,i,start,len,data,y);
+			if(len == l)
+				put_shared(i,l,data,y);
 		}
 		return data;
 	}
 
+	void get_Q2(int i, int j, int len, Qfloat **Q_i, Qfloat **Q_j) const
+	{
+		if(i == j)
+		{
+			*Q_i = *Q_j = get_Q(i,len);
+			return;
+		}
+		// the cache holds at least two columns, so getting j leaves i
+		int start_i = cache->get_data(i,Q_i,len);
+		int start_j = cache->get_data(j,Q_j,len);
+		if(!sharing())
+		{
+			fill_column2(cache,i,start_i,*Q_i,j,start_j,*Q_j,len,y);
+			return;
+		}
+		// what is left of them is computed together
+		bool put_i = start_i < len, put_j = start_j < len;
+		if(start_i < len && take_shared(cache,i,start_i,len,*Q_i,start_j < len ? j : -1,y))
+			start_i = len;
+		if(start_j < len && take_shared(cache,j,start_j,len,*Q_j,start_i < len ? i : -1,y))
+			start_j = len;
+		fill_column2(cache,i,start_i,*Q_i,j,start_j,*Q_j,len,y);
+		if(len == l)
+		{
+			if(put_i)
+				put_shared(i,l,*Q_i,y);
+			if(put_j)
+				put_shared(j,l,*Q_j,y);
+		}
+	}
+
+	int prefetch_len(int i, int len) const
+	{
+		if(cache->has_data(i,len))
+			return 0;
+		if(has_shared(i))
+			return 0;
+		return len;
+	}
+
+	void compute_Q(int i, int start, int end, Qfloat *buf) const
+	{
+		kernel_column(i,start,end,buf,y);
+	}
+
+	void store_Q(int i, int len, const Qfloat *buf) const
+	{
+		cache->put_data(i,buf,len);
+		if(len == l)
+			put_shared(i,l,buf,y);
+	}
+
+	void cache_counts(long int *hit, long int *miss) const
+	{
+		cache->get_counts(hit,miss);
+	}
+
 	double *get_QD() const
 	{
 		return QD;
@@ -1308,6 +4586,7 @@ public:
 		delete[] QD;
 	}
 private:
+	int l;
 	schar *y;
 	Cache *cache;
 	double *QD;
@@ -1316,27 +4595,88 @@ private:
 class ONE_CLASS_Q: public Kernel
 {
 public:
-	ONE_CLASS_Q(const svm_problem& prob, const svm_parameter& param)
-	:Kernel(prob.l, prob.x, param)
+	ONE_CLASS_Q(const problem_view& prob, const svm_parameter& param,
+		    const train_context *ctx)
+	:Kernel(prob.l, prob.x, prob.index, param)
 	{
-		cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)));
+		l = prob.l;
+		cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)),(long int)(param.spill_size*(1<<20)));
 		QD = new double[prob.l];
 		for(int i=0;i<prob.l;i++)
 			QD[i] = (this->*kernel_function)(i,i);
+		share(ctx->kernel_cache,ctx->kernel_index,prob.l);
+		use_file(ctx->kernel_file,prob.l);
 	}
 
 	Qfloat *get_Q(int i, int len) const
 	{
 		Qfloat *data;
-		int start, j;
+		int start;
 		if((start = cache->get_data(i,&data,len)) < len)
 		{
-			for(j=start;j<len;j++)
-				data[j] = (Qfloat)(this->*kernel_function)(i,j);
+			if(!(sharing() && take_shared(cache,i,start,len,data,-1,NULL)))
+				fill_column(cache,i,start,len,data,NULL);
+			if(len == l)
+				put_shared(i,l,data,NULL);
 		}
 		return data;
 	}
 
+	void get_Q2(int i, int j, int len, Qfloat **Q_i, Qfloat **Q_j) const
+	{
+		if(i == j)
+		{
+			*Q_i = *Q_j = get_Q(i,len);
+			return;
+		}
+		int start_i = cache->get_data(i,Q_i,len);
+		int start_j = cache->get_data(j,Q_j,len);
+		if(!sharing())
+		{
+			fill_column2(cache,i,start_i,*Q_i,j,start_j,*Q_j,len,NULL);
+			return;
+		}
+		bool put_i = start_i < len, put_j = start_j < len;
+		if(start_i < len && take_shared(cache,i,start_i,len,*Q_i,start_j < len ? j : -1,NULL))
+			start_i = len;
+		if(start_j < len && take_shared(cache,j,start_j,len,*Q_j,start_i < len ? i : -1,NULL))
+			start_j = len;
+		fill_column2(cache,i,start_i,*Q_i,j,start_j,*Q_j,len,NULL);
+		if(len == l)
+		{
+			if(put_i)
+				put_shared(i,l,*Q_i,NULL);
+			if(put_j)
+				put_shared(j,l,*Q_j,NULL);
+		}
+	}
+
+	int prefetch_len(int i, int len) const
+	{
+		if(cache->has_data(i,len))
+			return 0;
+		if(has_shared(i))
+			return 0;
+		return len;
+	}
+
+	void compute_Q(int i, int start, int end, Qfloat *buf) const
+	{
+		kernel_column(i,start,end,buf,NULL);
+	}
+
+	void store_Q(int i, int len, const Qfloat *buf) const
+	{
+		cache->put_data(i,buf,len);
+		if(len == l)
+			put_shared(i,l,buf,NULL);
+	}
+
+	void cache_counts(long int *hit, long int *miss) const
+	{
+		cache->get_counts(hit,miss);
+	}
+
 	double *get_QD() const
 	{
 		return QD;
@@ -1355,6 +4695,7 @@ public:
 		delete[] QD;
 	}
 private:
+	int l;
 	Cache *cache;
 	double *QD;
 };
@@ -1362,11 +4703,12 @@ private:
 class SVR_Q: public Kernel
 {
 public:
-	SVR_Q(const svm_problem& prob, const svm_parameter& param)
-	:Kernel(prob.l, prob.x, param)
+	SVR_Q(const problem_view& prob, const svm_parameter& param,
+	      const train_context *ctx)
+	:Kernel(prob.l, prob.x, prob.index, param)
 	{
 		l = prob.l;
-		cache = new Cache(l,(long int)(param.cache_size*(1<<20)));
+		cache = new Cache(l,(long int)(param.cache_size*(1<<20)),(long int)(param.spill_size*(1<<20)));
 		QD = new double[2*l];
 		sign = new schar[2*l];
 		index = new int[2*l];
@@ -1382,6 +4724,8 @@ public:
 		buffer[0] = new Qfloat[2*l];
 		buffer[1] = new Qfloat[2*l];
 		next_buffer = 0;
+		share(ctx->kernel_cache,ctx->kernel_index,l);
+		use_file(ctx->kernel_file,l);
 	}
 
 	void swap_index(int i, int j) const
@@ -1393,21 +4737,66 @@ public:
 
 	Qfloat *get_Q(int i, int len) const
 	{
-		Qfloat *data;
-		int j, real_i = index[i];
-		if(cache->get_data(real_i,&data,l) < l)
+		return reorder(i,len,get_column(index[i]));
+	}
+
+	void get_Q2(int i, int j, int len, Qfloat **Q_i, Qfloat **Q_j) const
+	{
+		int real_i = index[i], real_j = index[j];
+		if(real_i == real_j)
+		{
+			// i and j are the two copies of one instance
+			Qfloat *data = get_column(real_i);
+			*Q_i = reorder(i,len,data);
+			*Q_j = reorder(j,len,data);
+			return;
+		}
+		Qfloat *data_i, *data_j;
+		int start_i = cache->get_data(real_i,&data_i,l);
+		int start_j = cache->get_data(real_j,&data_j,l);
+		bool put_i = start_i < l, put_j = start_j < l;
+		if(sharing())
 		{
-			for(j=0;j<l;j++)
-				data[j] = (Qfloat)(this->*kernel_function)(real_i,j);
+			if(start_i < l && take_shared(cache,real_i,start_i,l,data_i,start_j < l ? real_j : -1,NULL))
+				start_i = l;
+			if(start_j < l && take_shared(cache,real_j,start_j,l,data_j,start_i < l ? real_i : -1,NULL))
+				start_j = l;
 		}
+		fill_column2(cache,real_i,start_i,data_i,real_j,start_j,data_j,l,NULL);
+		if(put_i)
+			put_shared(real_i,l,data_i,NULL);
+		if(put_j)
+			put_shared(real_j,l,data_j,NULL);
+		*Q_i = reorder(i,len,data_i);
+		*Q_j = reorder(j,len,data_j);
+	}
 
-		// reorder and copy
-		Qfloat *buf = buffer[next_buffer];
-		next_buffer = 1 - next_buffer;
-		schar si = sign[i];
-		for(j=0;j<len;j++)
-			buf[j] = (Qfloat) si * (Qfloat) sign[j] * data[index[j]];
-		return buf;
+	// the cache holds the real columns, of length l
+	int prefetch_len(int i, int len) const
+	{
+		if(cache->has_data(index[i],l))
+			return 0;
+		if(has_shared(index[i]))
+			return 0;
+		return l;
+	}
+
+	void compute_Q(int i, int start, int end, Qfloat *buf) const
+	{
+		kernel_column(index[i],start,end,buf,NULL);
+	}
+
+	void store_Q(int i, int len, const Qfloat *buf) const
+	{
+		cache->put_data(index[i],buf,len);
+		// past len the buffer is stale, so only whole columns are shared
+		if(len == l)
+			put_shared(index[i],l,buf,NULL);
+	}
+
+	void cache_counts(long int *hit, long int *miss) const
+	{
+		cache->get_counts(hit,miss);
 	}
 
 	double *get_QD() const
@@ -1432,31 +4821,137 @@ private:
 	mutable int next_buffer;
 	Qfloat *buffer[2];
 	double *QD;
+
+	// the real column of instance real_i
+	Qfloat *get_column(int real_i) const
+	{
+		Qfloat *data;
+		int start;
+		if((start = cache->get_data(real_i,&data,l)) < l)
+		{
+			if(!(sharing() && take_shared(cache,real_i,start,l,data,-1,NULL)))
+				fill_column(cache,real_i,start,l,data,NULL);
+			put_shared(real_i,l,data,NULL);
+		}
+		return data;
+	}
+
+	// reorder and copy column i
+	Qfloat *reorder(int i, int len, const Qfloat *data) const
+	{
+		Qfloat *buf = buffer[next_buffer];
+		next_buffer = 1 - next_buffer;
+		schar si = sign[i];
+		for(int j=0;j<len;j++)
+			buf[j] = (Qfloat) si * (Qfloat) sign[j] * data[index[j]];
+		return buf;
+	}
+};
+
+// the kernel values of instances against others in double, a column
+// at a time, for predicting many instances at once
+class PredictKernel: public Kernel
+{
+public:
+	PredictKernel(int l, svm_node * const * x, const svm_parameter& param)
+	:Kernel(l, x, NULL, param)
+	{
+	}
+
+	// data[j] = K(i,j) for j in [start,len)
+	void column(int i, int start, int len, double *data) const
+	{
+		kernel_column(i,start,len,data);
+	}
+	Qfloat *get_Q(int i, int len) const
+	{
+		return NULL;
+	}
+	double *get_QD() const
+	{
+		return NULL;
+	}
 };
 
 //
 // construct and solve various formulations
 //
+// clip alpha to [0,Cp] and [0,Cn] by y and scale down the side with the
+// larger sum, so that sum y[i]*alpha[i] = 0 and the solver may start
+// from it
+static void feasible_alpha(double *alpha, const schar *y, int l, double Cp, double Cn)
+{
+	int i;
+	double sum_p = 0, sum_n = 0;
+	for(i=0;i<l;i++)
+	{
+		alpha[i] = max(0.0,min(alpha[i],y[i] > 0 ? Cp : Cn));
+		if(y[i] > 0)
+			sum_p += alpha[i];
+		else
+			sum_n += alpha[i];
+	}
+	if(sum_p == sum_n)
+		return;
+	schar larger = sum_p > sum_n ? +1 : -1;
+	double scale = sum_p > sum_n ? sum_n/sum_p : sum_p/sum_n;
+	for(i=0;i<l;i++)
+		if(y[i] == larger)
+			alpha[i] *= scale;
+}
+
+// clip alpha to [0,1] and bring its sum to total, scaling it down or
+// filling up the nonzero entries and then the others in order, so that
+// one-class SVM may start from it
+static void feasible_nu_alpha(double *alpha, int l, double total)
+{
+	int i;
+	double sum = 0;
+	for(i=0;i<l;i++)
+	{
+		alpha[i] = max(0.0,min(alpha[i],1.0));
+		sum += alpha[i];
+	}
+	if(sum > total)
+	{
+		for(i=0;i<l;i++)
+			alpha[i] *= total/sum;
+		return;
+	}
+	for(int pass=0;pass<2;pass++)
+		for(i=0;i<l && sum < total;i++)
+			if((alpha[i] > 0) == (pass == 0))
+			{
+				double d = min(1.0-alpha[i],total-sum);
+				alpha[i] += d;
+				sum += d;
+			}
+}
+
 static void solve_c_svc(
-	const svm_problem *prob, const svm_parameter* param,
-	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn)
+	const problem_view *prob, const svm_parameter* param,
+	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn,
+	train_context *ctx)
 {
 	int l = prob->l;
-	double *minus_ones = new double[l];
-	schar *y = new schar[l];
+	double *minus_ones = ctx->workspace->get<double>(Workspace::FORM_LINEAR,l);
+	schar *y = ctx->workspace->get<schar>(Workspace::FORM_Y,l);
 
 	int i;
 
 	for(i=0;i<l;i++)
 	{
-		alpha[i] = 0;
+		alpha[i] = ctx->initial_alpha ? ctx->initial_alpha[i] : 0;
 		minus_ones[i] = -1;
-		if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
+		if(prob->label(i) > 0) y[i] = +1; else y[i] = -1;
 	}
+	if(ctx->initial_alpha)
+		feasible_alpha(alpha,y,l,Cp,Cn);
 
 	Solver s;
-	s.Solve(l, SVC_Q(*prob,*param,y), minus_ones, y,
-		alpha, Cp, Cn, param->eps, si, param->shrinking);
+	s.Solve(l, SVC_Q(*prob,*param,y,ctx), minus_ones, y,
+		alpha, Cp, Cn, param->eps, si, param->shrinking, param->nr_thread,
+		param->working_set_size, param->max_iter, ctx);
 
 	double sum_alpha=0;
 	for(i=0;i<l;i++)
@@ -1467,23 +4962,20 @@ static void solve_c_svc(
 
 	for(i=0;i<l;i++)
 		alpha[i] *= y[i];
-
-	delete[] minus_ones;
-	delete[] y;
 }
 
 static void solve_nu_svc(
-	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	const problem_view *prob, const svm_parameter *param,
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int i;
 	int l = prob->l;
 	double nu = param->nu;
 
-	schar *y = new schar[l];
+	schar *y = ctx->workspace->get<schar>(Workspace::FORM_Y,l);
 
 	for(i=0;i<l;i++)
-		if(prob->y[i]>0)
+		if(prob->label(i)>0)
 			y[i] = +1;
 		else
 			y[i] = -1;
@@ -1503,14 +4995,15 @@ static void solve_nu_svc(
 			sum_neg -= alpha[i];
 		}
 
-	double *zeros = new double[l];
+	double *zeros = ctx->workspace->get<double>(Workspace::FORM_LINEAR,l);
 
 	for(i=0;i<l;i++)
 		zeros[i] = 0;
 
 	Solver_NU s;
-	s.Solve(l, SVC_Q(*prob,*param,y), zeros, y,
-		alpha, 1.0, 1.0, param->eps, si,  param->shrinking);
+	s.Solve(l, SVC_Q(*prob,*param,y,ctx), zeros, y,
+		alpha, 1.0, 1.0, param->eps, si, param->shrinking, param->nr_thread,
+		param->max_iter, ctx);
 	double r = si->r;
 
 	info("C = %f\n",1/r);
@@ -1522,28 +5015,34 @@ static void solve_nu_svc(
 	si->obj /= (r*r);
 	si->upper_bound_p = 1/r;
 	si->upper_bound_n = 1/r;
-
-	delete[] y;
-	delete[] zeros;
 }
 
 static void solve_one_class(
-	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	const problem_view *prob, const svm_parameter *param,
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int l = prob->l;
-	double *zeros = new double[l];
-	schar *ones = new schar[l];
+	double *zeros = ctx->workspace->get<double>(Workspace::FORM_LINEAR,l);
+	schar *ones = ctx->workspace->get<schar>(Workspace::FORM_Y,l);
 	int i;
 
-	int n = (int)(param->nu*prob->l);	// # of alpha's at upper bound
-
-	for(i=0;i<n;i++)
-		alpha[i] = 1;
-	if(n<prob->l)
-		alpha[n] = param->nu * prob->l - n;
-	for(i=n+1;i<l;i++)
-		alpha[i] = 0;
+	if(ctx->initial_alpha)
+	{
+		for(i=0;i<l;i++)
+			alpha[i] = ctx->initial_alpha[i];
+		feasible_nu_alpha(alpha,l,param->nu*prob->l);
+	}
+	else
+	{
+		int n = (int)(param->nu*prob->l);	// # of alpha's at upper bound
+
+		for(i=0;i<n;i++)
+			alpha[i] = 1;
+		if(n<prob->l)
+			alpha[n] = param->nu * prob->l - n;
+		for(i=n+1;i<l;i++)
+			alpha[i] = 0;
+	}
 
 	for(i=0;i<l;i++)
 	{
@@ -1552,37 +5051,39 @@ static void solve_one_class(
 	}
 
 	Solver s;
-	s.Solve(l, ONE_CLASS_Q(*prob,*param), zeros, ones,
-		alpha, 1.0, 1.0, param->eps, si, param->shrinking);
-
-	delete[] zeros;
-	delete[] ones;
+	s.Solve(l, ONE_CLASS_Q(*prob,*param,ctx), zeros, ones,
+		alpha, 1.0, 1.0, param->eps, si, param->shrinking, param->nr_thread,
+		param->working_set_size, param->max_iter, ctx);
 }
 
 static void solve_epsilon_svr(
-	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	const problem_view *prob, const svm_parameter *param,
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int l = prob->l;
-	double *alpha2 = new double[2*l];
-	double *linear_term = new double[2*l];
-	schar *y = new schar[2*l];
+	double *alpha2 = ctx->workspace->get<double>(Workspace::FORM_ALPHA,2*l);
+	double *linear_term = ctx->workspace->get<double>(Workspace::FORM_LINEAR,2*l);
+	schar *y = ctx->workspace->get<schar>(Workspace::FORM_Y,2*l);
 	int i;
 
 	for(i=0;i<l;i++)
 	{
-		alpha2[i] = 0;
-		linear_term[i] = param->p - prob->y[i];
+		double a = ctx->initial_alpha ? ctx->initial_alpha[i] : 0;
+		alpha2[i] = max(a,0.0);
+		linear_term[i] = param->p - prob->label(i);
 		y[i] = 1;
 
-		alpha2[i+l] = 0;
-		linear_term[i+l] = param->p + prob->y[i];
+		alpha2[i+l] = max(-a,0.0);
+		linear_term[i+l] = param->p + prob->label(i);
 		y[i+l] = -1;
 	}
+	if(ctx->initial_alpha)
+		feasible_alpha(alpha2,y,2*l,param->C,param->C);
 
 	Solver s;
-	s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
-		alpha2, param->C, param->C, param->eps, si, param->shrinking);
+	s.Solve(2*l, SVR_Q(*prob,*param,ctx), linear_term, y,
+		alpha2, param->C, param->C, param->eps, si, param->shrinking, param->nr_thread,
+		param->working_set_size, param->max_iter, ctx);
 
 	double sum_alpha = 0;
 	for(i=0;i<l;i++)
@@ -1591,21 +5092,17 @@ static void solve_epsilon_svr(
 		sum_alpha += fabs(alpha[i]);
 	}
 	info("nu = %f\n",sum_alpha/(param->C*l));
-
-	delete[] alpha2;
-	delete[] linear_term;
-	delete[] y;
 }
 
 static void solve_nu_svr(
-	const svm_problem *prob, const svm_parameter *param,
-	double *alpha, Solver::SolutionInfo* si)
+	const problem_view *prob, const svm_parameter *param,
+	double *alpha, Solver::SolutionInfo* si, train_context *ctx)
 {
 	int l = prob->l;
 	double C = param->C;
-	double *alpha2 = new double[2*l];
-	double *linear_term = new double[2*l];
-	schar *y = new schar[2*l];
+	double *alpha2 = ctx->workspace->get<double>(Workspace::FORM_ALPHA,2*l);
+	double *linear_term = ctx->workspace->get<double>(Workspace::FORM_LINEAR,2*l);
+	schar *y = ctx->workspace->get<schar>(Workspace::FORM_Y,2*l);
 	int i;
 
 	double sum = C * param->nu * l / 2;
@@ -1614,25 +5111,22 @@ static void solve_nu_svr(
 		alpha2[i] = alpha2[i+l] = min(sum,C);
 		sum -= alpha2[i];
 
-		linear_term[i] = - prob->y[i];
+		linear_term[i] = - prob->label(i);
 		y[i] = 1;
 
-		linear_term[i+l] = prob->y[i];
+		linear_term[i+l] = prob->label(i);
 		y[i+l] = -1;
 	}
 
 	Solver_NU s;
-	s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
-		alpha2, C, C, param->eps, si, param->shrinking);
+	s.Solve(2*l, SVR_Q(*prob,*param,ctx), linear_term, y,
+		alpha2, C, C, param->eps, si, param->shrinking, param->nr_thread,
+		param->max_iter, ctx);
 
 	info("epsilon = %f\n",-si->r);
 
 	for(i=0;i<l;i++)
 		alpha[i] = alpha2[i] - alpha2[i+l];
-
-	delete[] alpha2;
-	delete[] linear_term;
-	delete[] y;
 }
 
 //
@@ -1645,27 +5139,27 @@ struct decision_function
 };
 
 static decision_function svm_train_one(
-	const svm_problem *prob, const svm_parameter *param,
-	double Cp, double Cn)
+	const problem_view *prob, const svm_parameter *param,
+	double Cp, double Cn, train_context *ctx)
 {
 	double *alpha = Malloc(double,prob->l);
 	Solver::SolutionInfo si;
 	switch(param->svm_type)
 	{
 		case C_SVC:
-			solve_c_svc(prob,param,alpha,&si,Cp,Cn);
+			solve_c_svc(prob,param,alpha,&si,Cp,Cn,ctx);
 			break;
 		case NU_SVC:
-			solve_nu_svc(prob,param,alpha,&si);
+			solve_nu_svc(prob,param,alpha,&si,ctx);
 			break;
 		case ONE_CLASS:
-			solve_one_class(prob,param,alpha,&si);
+			solve_one_class(prob,param,alpha,&si,ctx);
 			break;
 		case EPSILON_SVR:
-			solve_epsilon_svr(prob,param,alpha,&si);
+			solve_epsilon_svr(prob,param,alpha,&si,ctx);
 			break;
 		case NU_SVR:
-			solve_nu_svr(prob,param,alpha,&si);
+			solve_nu_svr(prob,param,alpha,&si,ctx);
 			break;
 	}
 
@@ -1680,7 +5174,7 @@ static decision_function svm_train_one(
 		if(fabs(alpha[i]) > 0)
 		{
 			++nSV;
-			if(prob->y[i] > 0)
+			if(prob->label(i) > 0)
 			{
 				if(fabs(alpha[i]) >= si.upper_bound_p)
 					++nBSV;
@@ -1870,115 +5364,340 @@ static void multiclass_probability(int k, double **r, double *p)
 		}
 		if (max_error<eps) break;
 
-		for (t=0;t<k;t++)
-		{
-			double diff=(-Qp[t]+pQp)/Q[t][t];
-			p[t]+=diff;
-			pQp=(pQp+diff*(diff*Q[t][t]+2*Qp[t]))/(1+diff)/(1+diff);
-			for (j=0;j<k;j++)
-			{
-				Qp[j]=(Qp[j]+diff*Q[t][j])/(1+diff);
-				p[j]/=(1+diff);
-			}
-		}
+		for (t=0;t<k;t++)
+		{
+			double diff=(-Qp[t]+pQp)/Q[t][t];
+			p[t]+=diff;
+			pQp=(pQp+diff*(diff*Q[t][t]+2*Qp[t]))/(1+diff)/(1+diff);
+			for (j=0;j<k;j++)
+			{
+				Qp[j]=(Qp[j]+diff*Q[t][j])/(1+diff);
+				p[j]/=(1+diff);
+			}
+		}
+	}
+	if (iter>=max_iter)
+		info("Exceeds max_iter in multiclass_prob\n");
+	for(t=0;t<k;t++) free(Q[t]);
+	free(Q);
+	free(Qp);
+}
+
+// 64-bit FNV-1a over the bytes of what determines the subproblems
+static unsigned long long hash_bytes(unsigned long long h, const void *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for(size_t k=0;k<n;k++)
+		h = (h ^ p[k]) * 1099511628211ull;
+	return h;
+}
+
+// index and value separately, as svm_node has padding after index;
+// the terminating index keeps the instance boundaries in the hash
+static unsigned long long hash_instances(unsigned long long h, const svm_problem *prob)
+{
+	for(int i=0;i<prob->l;i++)
+	{
+		const svm_node *px = prob->x[i];
+		for(;px->index != -1;px++)
+		{
+			h = hash_bytes(h,&px->index,sizeof(int));
+			h = hash_bytes(h,&px->value,sizeof(double));
+		}
+		h = hash_bytes(h,&px->index,sizeof(int));
+	}
+	return h;
+}
+
+static unsigned long long checkpoint_hash(const svm_problem *prob, const svm_parameter *param)
+{
+	unsigned long long h = 14695981039346656037ull;
+	h = hash_bytes(h,&param->svm_type,sizeof(int));
+	h = hash_bytes(h,&param->kernel_type,sizeof(int));
+	h = hash_bytes(h,&param->degree,sizeof(int));
+	h = hash_bytes(h,&param->gamma,sizeof(double));
+	h = hash_bytes(h,&param->coef0,sizeof(double));
+	h = hash_bytes(h,&param->eps,sizeof(double));
+	h = hash_bytes(h,&param->C,sizeof(double));
+	h = hash_bytes(h,&param->nu,sizeof(double));
+	h = hash_bytes(h,&param->p,sizeof(double));
+	h = hash_bytes(h,&param->nr_weight,sizeof(int));
+	h = hash_bytes(h,param->weight_label,sizeof(int)*param->nr_weight);
+	h = hash_bytes(h,param->weight,sizeof(double)*param->nr_weight);
+	h = hash_bytes(h,&prob->l,sizeof(int));
+	h = hash_bytes(h,prob->y,sizeof(double)*prob->l);
+	return hash_instances(h,prob);
+}
+
+// the kernel over the instances, with the parameters the kernel takes
+static unsigned long long kernel_hash(const svm_problem *prob, const svm_parameter *param)
+{
+	unsigned long long h = 14695981039346656037ull;
+	h = hash_bytes(h,&param->kernel_type,sizeof(int));
+	if(param->kernel_type == POLY)
+		h = hash_bytes(h,&param->degree,sizeof(int));
+	if(param->kernel_type == POLY || param->kernel_type == RBF || param->kernel_type == SIGMOID)
+		h = hash_bytes(h,&param->gamma,sizeof(double));
+	if(param->kernel_type == POLY || param->kernel_type == SIGMOID)
+		h = hash_bytes(h,&param->coef0,sizeof(double));
+	h = hash_bytes(h,&prob->l,sizeof(int));
+	return hash_instances(h,prob);
+}
+
+// the kernel file of param for the instances of prob, NULL if none or
+// it cannot be used
+static KernelFile *open_kernel_file(const svm_problem *prob, const svm_parameter *param)
+{
+	if(!param->kernel_file)
+		return NULL;
+	KernelFile *file = new KernelFile(prob);
+	if(!file->open(param->kernel_file,kernel_hash(prob,param),param->kernel_file_size*(1<<20)))
+	{
+		delete file;
+		return NULL;
+	}
+	return file;
+}
+
+static void close_kernel_file(KernelFile *file)
+{
+	if(!file)
+		return;
+	long int hit, miss;
+	file->get_counts(&hit,&miss);
+	info("kernel file: %ld columns found, %ld missed\n",hit,miss);
+	delete file;
+}
+
+// the max_time of the trainings within one, so they end by its deadline
+static double remaining_time(double deadline)
+{
+	if(deadline <= 0)
+		return 0;
+	return max(deadline - wall_time(),1e-9);
+}
+
+// a random number from rand(), or from the state of trainings that run
+// side by side, whose order of calls to rand() would depend on the
+// threads
+static int next_random(unsigned long long *state)
+{
+	if(!state)
+		return rand();
+	*state = *state*6364136223846793005ULL+1442695040888963407ULL;
+	return (int)(*state >> 33);
+}
+
+// random shuffle
+static void random_shuffle(int *perm, int l, unsigned long long *state)
+{
+	int i;
+	for(i=0;i<l;i++) perm[i]=i;
+	for(i=0;i<l;i++)
+	{
+		int j = i+next_random(state)%(l-i);
+		swap(perm[i],perm[j]);
+	}
+}
+
+// pairs smaller than this are not split over threads: with fewer pairs
+// than threads they are still solved side by side, each on one thread
+#define PAIR_THREADS_MIN 32768
+
+// a binary problem of svm_train, pair i-j of the classes and number p
+struct pair_job
+{
+	int p, i, j;
+	int l;
+};
+
+static int compare_pair_job(const void *a, const void *b)
+{
+	const pair_job *x = (const pair_job *)a, *y = (const pair_job *)b;
+	if(x->l != y->l)
+		return x->l > y->l ? -1 : 1;
+	return x->p - y->p;
+}
+
+// the trainings within one take its workspace, kernel cache and random
+// numbers from outer, NULL for none
+static svm_model *train(const svm_problem *prob, const svm_parameter *param,
+			bool resume, const double *initial_alpha,
+			const train_context *outer);
+static void cross_validation(const svm_problem *prob, const svm_parameter *param,
+			     int nr_fold, double *target, const train_context *outer);
+
+// the folds of the cross validation for probability estimates
+#define PROBABILITY_FOLD 5
+
+// Kernel cache of the cross validation for probability estimates over
+// the l instances of a pair in the order of its shuffle, one group per
+// fold; NULL if it takes more than max_size MB, else its size in *size
+static SharedCache *probability_cache(int l, double max_size, double *size)
+{
+	int start[PROBABILITY_FOLD], count[PROBABILITY_FOLD];
+	for(int i=0;i<PROBABILITY_FOLD;i++)
+	{
+		start[i] = i*l/PROBABILITY_FOLD;
+		count[i] = (i+1)*l/PROBABILITY_FOLD-start[i];
 	}
-	if (iter>=max_iter)
-		info("Exceeds max_iter in multiclass_prob\n");
-	for(t=0;t<k;t++) free(Q[t]);
-	free(Q);
-	free(Qp);
+	*size = SharedCache::size(l,PROBABILITY_FOLD,count,false)/(1<<20);
+	if(*size > max_size)
+		return NULL;
+	return new SharedCache(l,PROBABILITY_FOLD,start,count,false,0);
 }
 
 // Cross-validation decision values for probability estimates
-static void svm_binary_svc_probability(
-	const svm_problem *prob, const svm_parameter *param,
-	double Cp, double Cn, double& probA, double& probB)
+//
+// The folds run side by side with more than one thread. Given alpha, of
+// C-SVC, it also takes the mean of the fold solutions, which is feasible
+// as every instance is in all folds but one, and returns whether it did
+static bool svm_binary_svc_probability(
+	const problem_view *prob, const svm_parameter *param,
+	double Cp, double Cn, double& probA, double& probB, const int *perm,
+	train_context *ctx, double *alpha)
 {
 	int i;
-	int nr_fold = 5;
-	int *perm = Malloc(int,prob->l);
-	double *dec_values = Malloc(double,prob->l);
-
-	// random shuffle
-	for(i=0;i<prob->l;i++) perm[i]=i;
-	for(i=0;i<prob->l;i++)
+	int nr_fold = PROBABILITY_FOLD;
+	int l = prob->l;
+	double *dec_values = Malloc(double,l);
+	double *fold_alpha = alpha ? Malloc(double,(size_t)nr_fold*l) : NULL;
+	bool solved = true;
+
+	// each fold is then solved on one thread with its part of the cache
+	svm_parameter fold_param = *param;
+#ifdef _OPENMP
+	int nr_fold_thread = 1;
+	int nr_thread = param->nr_thread > 0 ? param->nr_thread : omp_get_max_threads();
+	if(nr_thread > 1)
 	{
-		int j = i+rand()%(prob->l-i);
-		swap(perm[i],perm[j]);
+		nr_fold_thread = min(nr_thread,nr_fold);
+		fold_param.nr_thread = 1;
+		fold_param.cache_size /= nr_fold_thread;
+		fold_param.spill_size /= nr_fold_thread;
 	}
-	for(i=0;i<nr_fold;i++)
+#pragma omp parallel num_threads(nr_fold_thread) if(nr_fold_thread > 1)
+#endif
 	{
-		int begin = i*prob->l/nr_fold;
-		int end = (i+1)*prob->l/nr_fold;
-		int j,k;
-		struct svm_problem subprob;
-
-		subprob.l = prob->l-(end-begin);
-		subprob.x = Malloc(struct svm_node*,subprob.l);
-		subprob.y = Malloc(double,subprob.l);
-
-		k=0;
-		for(j=0;j<begin;j++)
-		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
-		}
-		for(j=end;j<prob->l;j++)
+		Workspace thread_workspace;
+		Workspace *workspace = ctx->workspace;
+#ifdef _OPENMP
+		if(omp_get_thread_num() > 0)
+			workspace = &thread_workspace;
+#pragma omp for schedule(dynamic,1) reduction(&&:solved)
+#endif
+		for(i=0;i<nr_fold;i++)
 		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
-		}
-		int p_count=0,n_count=0;
-		for(j=0;j<k;j++)
-			if(subprob.y[j]>0)
-				p_count++;
+			int begin = i*l/nr_fold;
+			int end = (i+1)*l/nr_fold;
+			int j,k;
+			struct svm_problem subprob;
+
+			subprob.l = l-(end-begin);
+			subprob.x = Malloc(struct svm_node*,subprob.l);
+			subprob.y = Malloc(double,subprob.l);
+			int *instance = Malloc(int,subprob.l);
+
+			k=0;
+			for(j=0;j<begin;j++)
+				instance[k++] = perm[j];
+			for(j=end;j<l;j++)
+				instance[k++] = perm[j];
+			for(k=0;k<subprob.l;k++)
+			{
+				subprob.x[k] = prob->node(instance[k]);
+				subprob.y[k] = prob->label(instance[k]);
+			}
+			int p_count=0,n_count=0;
+			for(j=0;j<k;j++)
+				if(subprob.y[j]>0)
+					p_count++;
+				else
+					n_count++;
+
+			if(p_count==0 || n_count==0)
+				solved = false;
+			if(p_count==0 && n_count==0)
+				for(j=begin;j<end;j++)
+					dec_values[perm[j]] = 0;
+			else if(p_count > 0 && n_count == 0)
+				for(j=begin;j<end;j++)
+					dec_values[perm[j]] = 1;
+			else if(p_count == 0 && n_count > 0)
+				for(j=begin;j<end;j++)
+					dec_values[perm[j]] = -1;
 			else
-				n_count++;
-
-		if(p_count==0 && n_count==0)
-			for(j=begin;j<end;j++)
-				dec_values[perm[j]] = 0;
-		else if(p_count > 0 && n_count == 0)
-			for(j=begin;j<end;j++)
-				dec_values[perm[j]] = 1;
-		else if(p_count == 0 && n_count > 0)
-			for(j=begin;j<end;j++)
-				dec_values[perm[j]] = -1;
-		else
-		{
-			svm_parameter subparam = *param;
-			subparam.probability=0;
-			subparam.C=1.0;
-			subparam.nr_weight=2;
-			subparam.weight_label = Malloc(int,2);
-			subparam.weight = Malloc(double,2);
-			subparam.weight_label[0]=+1;
-			subparam.weight_label[1]=-1;
-			subparam.weight[0]=Cp;
-			subparam.weight[1]=Cn;
-			struct svm_model *submodel = svm_train(&subprob,&subparam);
-			for(j=begin;j<end;j++)
-			{
-				svm_predict_values(submodel,prob->x[perm[j]],&(dec_values[perm[j]]));
-				// ensure +1 -1 order; reason not using CV subroutine
-				dec_values[perm[j]] *= submodel->label[0];
+			{
+				svm_parameter subparam = fold_param;
+				subparam.probability=0;
+				subparam.max_time=remaining_time(ctx->deadline);
+				subparam.checkpoint_file=NULL;
+				subparam.C=1.0;
+				subparam.nr_weight=2;
+				subparam.weight_label = Malloc(int,2);
+				subparam.weight = Malloc(double,2);
+				subparam.weight_label[0]=+1;
+				subparam.weight_label[1]=-1;
+				subparam.weight[0]=Cp;
+				subparam.weight[1]=Cn;
+				int *index = NULL;
+				if(ctx->kernel_cache)
+				{
+					index = Malloc(int,subprob.l);
+					for(k=0;k<subprob.l;k++)
+						index[k] = ctx->kernel_index[instance[k]];
+				}
+				train_context fold_ctx = *ctx;
+				fold_ctx.workspace = workspace;
+				fold_ctx.kernel_index = index;
+				struct svm_model *submodel = train(&subprob,&subparam,false,NULL,&fold_ctx);
+				for(j=begin;j<end;j++)
+				{
+					svm_predict_values(submodel,prob->node(perm[j]),&(dec_values[perm[j]]));
+					// ensure +1 -1 order; reason not using CV subroutine
+					dec_values[perm[j]] *= submodel->label[0];
+				}
+				if(fold_alpha)
+				{
+					double *a = fold_alpha+(size_t)i*l;
+					for(j=0;j<l;j++)
+						a[j] = 0;
+					for(j=0;j<submodel->l;j++)
+						a[instance[submodel->sv_indices[j]-1]] = fabs(submodel->sv_coef[0][j]);
+				}
+				svm_free_and_destroy_model(&submodel);
+				svm_destroy_param(&subparam);
+				free(index);
 			}
-			svm_free_and_destroy_model(&submodel);
-			svm_destroy_param(&subparam);
+			free(subprob.x);
+			free(subprob.y);
+			free(instance);
 		}
-		free(subprob.x);
-		free(subprob.y);
 	}
-	sigmoid_train(prob->l,dec_values,prob->y,probA,probB);
+	double *labels = Malloc(double,l);
+	for(i=0;i<l;i++)
+		labels[i] = prob->label(i);
+	sigmoid_train(l,dec_values,labels,probA,probB);
+	free(labels);
 	free(dec_values);
-	free(perm);
+
+	if(!fold_alpha)
+		return false;
+	if(solved)
+		for(int j=0;j<l;j++)
+		{
+			double sum = 0;
+			for(i=0;i<nr_fold;i++)
+				sum += fold_alpha[(size_t)i*l+j];
+			alpha[j] = min(sum/(nr_fold-1),prob->label(j) > 0 ? Cp : Cn);
+		}
+	free(fold_alpha);
+	return solved;
 }
 
 // Return parameter of a Laplace distribution
 static double svm_svr_probability(
-	const svm_problem *prob, const svm_parameter *param)
+	const svm_problem *prob, const svm_parameter *param, train_context *ctx)
 {
 	int i;
 	int nr_fold = 5;
@@ -1987,7 +5706,8 @@ static double svm_svr_probability(
 
 	svm_parameter newparam = *param;
 	newparam.probability = 0;
-	svm_cross_validation(prob,&newparam,nr_fold,ymv);
+	newparam.max_time = remaining_time(ctx->deadline);
+	cross_validation(prob,&newparam,nr_fold,ymv,ctx);
 	for(i=0;i<prob->l;i++)
 	{
 		ymv[i]=prob->y[i]-ymv[i];
@@ -2089,8 +5809,31 @@ static void svm_group_classes(const svm_problem *prob, int *nr_class_ret, int **
 //
 // Interface functions
 //
-svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
+static svm_model *train(const svm_problem *prob, const svm_parameter *param,
+			bool resume, const double *initial_alpha,
+			const train_context *outer)
 {
+	// one time budget for the whole model
+	train_context ctx;
+	Workspace *own_workspace = outer ? NULL : new Workspace;
+	ctx.workspace = outer ? outer->workspace : own_workspace;
+	ctx.deadline = param->max_time > 0 ? wall_time() + param->max_time : 0;
+	ctx.checkpoint = NULL;
+	ctx.subproblem = 0;
+	ctx.kernel_cache = outer ? outer->kernel_cache : NULL;
+	ctx.kernel_index = outer ? outer->kernel_index : NULL;
+	KernelFile *own_file = outer ? NULL : open_kernel_file(prob,param);
+	ctx.kernel_file = outer ? outer->kernel_file : own_file;
+	ctx.initial_alpha = NULL;
+	ctx.random_state = outer ? outer->random_state : NULL;
+	if(param->checkpoint_file)
+	{
+		ctx.checkpoint = new Checkpoint(param->checkpoint_file,param->checkpoint_interval,
+						checkpoint_hash(prob,param));
+		if(resume && !ctx.checkpoint->load())
+			info("cannot resume from %s, training from the start\n",param->checkpoint_file);
+	}
+
 	svm_model *model = Malloc(svm_model,1);
 	model->param = *param;
 	model->free_sv = 0;	// XXX
@@ -2111,10 +5854,12 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 		    param->svm_type == NU_SVR))
 		{
 			model->probA = Malloc(double,1);
-			model->probA[0] = svm_svr_probability(prob,param);
+			model->probA[0] = svm_svr_probability(prob,param,&ctx);
 		}
 
-		decision_function f = svm_train_one(prob,param,0,0);
+		ctx.initial_alpha = initial_alpha;
+		problem_view view(prob);
+		decision_function f = svm_train_one(&view,param,0,0,&ctx);
 		model->rho = Malloc(double,1);
 		model->rho[0] = f.rho;
 
@@ -2189,42 +5934,193 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 			probB=Malloc(double,nr_class*(nr_class-1)/2);
 		}
 
+		// the pairs, largest first, so that the threads run out of work
+		// at about the same time
+		int nr_pair = nr_class*(nr_class-1)/2;
+		pair_job *job = Malloc(pair_job,nr_pair);
 		int p = 0;
 		for(i=0;i<nr_class;i++)
 			for(int j=i+1;j<nr_class;j++)
 			{
-				svm_problem sub_prob;
+				job[p].p = p;
+				job[p].i = i;
+				job[p].j = j;
+				job[p].l = count[i]+count[j];
+				++p;
+			}
+		qsort(job,(size_t)nr_pair,sizeof(pair_job),compare_pair_job);
+
+		// the shuffles of the probability cross validations, drawn in the
+		// serial order so that the model does not depend on the threads
+		int **shuffle = NULL;
+		if(param->probability)
+		{
+			shuffle = Malloc(int *,nr_pair);
+			p = 0;
+			for(i=0;i<nr_class;i++)
+				for(int j=i+1;j<nr_class;j++)
+				{
+					shuffle[p] = Malloc(int,count[i]+count[j]);
+					random_shuffle(shuffle[p],count[i]+count[j],ctx.random_state);
+					++p;
+				}
+		}
+
+		// with more than one pair, the values within the classes are
+		// shared by them if they fit in half of the cache, unless the
+		// caller shares its own
+		svm_parameter pair_param = *param;
+		SharedCache *class_cache = NULL;
+		double shared_size = SharedCache::size(l,nr_class,count,true)/(1<<20);
+		if(!ctx.kernel_cache && nr_pair > 1 && shared_size <= param->cache_size/2)
+		{
+			class_cache = new SharedCache(l,nr_class,start,count,true,0);
+			pair_param.cache_size -= shared_size;
+		}
+		SharedCache *kernel_cache = ctx.kernel_cache ? ctx.kernel_cache : class_cache;
+
+		// solve pairs side by side if there are enough of them for the
+		// threads, or they are too small for the threads to share one;
+		// each is then solved on one thread with its part of the cache
+#ifdef _OPENMP
+		int nr_pair_thread = 1;
+		int nr_thread = param->nr_thread > 0 ? param->nr_thread : omp_get_max_threads();
+		if(nr_thread > 1 && nr_pair > 1 &&
+		   (nr_pair >= nr_thread || job[0].l < PAIR_THREADS_MIN))
+		{
+			nr_pair_thread = min(nr_thread,nr_pair);
+			pair_param.nr_thread = 1;
+			pair_param.cache_size /= nr_pair_thread;
+			pair_param.spill_size /= nr_pair_thread;
+		}
+#pragma omp parallel num_threads(nr_pair_thread) if(nr_pair_thread > 1)
+#endif
+		{
+			// a workspace for each thread, and the number of the pair for
+			// the checkpoint
+			train_context pair_ctx = ctx;
+			Workspace thread_workspace;
+#ifdef _OPENMP
+			if(omp_get_thread_num() > 0)
+				pair_ctx.workspace = &thread_workspace;
+#pragma omp for schedule(dynamic,1)
+#endif
+			for(int t=0;t<nr_pair;t++)
+			{
+				int p = job[t].p;
+				int i = job[t].i, j = job[t].j;
 				int si = start[i], sj = start[j];
 				int ci = count[i], cj = count[j];
-				sub_prob.l = ci+cj;
-				sub_prob.x = Malloc(svm_node *,sub_prob.l);
-				sub_prob.y = Malloc(double,sub_prob.l);
 				int k;
-				for(k=0;k<ci;k++)
+				// the pair over x, class i being +1; adjacent classes
+				// are a range of it
+				int *instance = NULL;
+				if(sj != si+ci)
 				{
-					sub_prob.x[k] = x[si+k];
-					sub_prob.y[k] = +1;
+					instance = Malloc(int,ci+cj);
+					for(k=0;k<ci;k++)
+						instance[k] = si+k;
+					for(k=0;k<cj;k++)
+						instance[ci+k] = sj+k;
 				}
-				for(k=0;k<cj;k++)
+				problem_view sub_prob(ci+cj,instance ? x : x+si,instance,ci);
+
+				int *index = NULL;
+				if(kernel_cache)
 				{
-					sub_prob.x[ci+k] = x[sj+k];
-					sub_prob.y[ci+k] = -1;
+					index = Malloc(int,sub_prob.l);
+					for(k=0;k<ci;k++)
+						index[k] = si+k;
+					for(k=0;k<cj;k++)
+						index[ci+k] = sj+k;
+					if(ctx.kernel_index)
+						for(k=0;k<sub_prob.l;k++)
+							index[k] = ctx.kernel_index[perm[index[k]]];
 				}
-
+				pair_ctx.kernel_cache = kernel_cache;
+				pair_ctx.kernel_index = index;
+				pair_ctx.subproblem = p;
+
+				// the cross validation and the solve of the pair share
+				// the values over it if they fit in half of its cache,
+				// and the solve starts from the folds' solutions
+				svm_parameter one_param = pair_param;
+				SharedCache *fold_cache = NULL;
+				double *alpha = NULL;
 				if(param->probability)
-					svm_binary_svc_probability(&sub_prob,param,weighted_C[i],weighted_C[j],probA[p],probB[p]);
+				{
+					double fold_size;
+					fold_cache = probability_cache(sub_prob.l,one_param.cache_size/2,&fold_size);
+					if(fold_cache)
+					{
+						one_param.cache_size -= fold_size;
+						if(!index)
+							index = Malloc(int,sub_prob.l);
+						for(k=0;k<sub_prob.l;k++)
+							index[shuffle[p][k]] = k;
+						pair_ctx.kernel_cache = fold_cache;
+						pair_ctx.kernel_index = index;
+					}
+					if(param->svm_type == C_SVC)
+						alpha = Malloc(double,sub_prob.l);
+					if(!svm_binary_svc_probability(&sub_prob,&one_param,weighted_C[i],weighted_C[j],
+								       probA[p],probB[p],shuffle[p],&pair_ctx,alpha))
+					{
+						free(alpha);
+						alpha = NULL;
+					}
+				}
+				if(!alpha && initial_alpha && param->svm_type == C_SVC)
+				{
+					// rows j-1 and i, as in sv_coef
+					alpha = Malloc(double,sub_prob.l);
+					for(k=0;k<ci;k++)
+						alpha[k] = fabs(initial_alpha[(size_t)(j-1)*l+perm[si+k]]);
+					for(k=0;k<cj;k++)
+						alpha[ci+k] = fabs(initial_alpha[(size_t)i*l+perm[sj+k]]);
+				}
 
-				f[p] = svm_train_one(&sub_prob,param,weighted_C[i],weighted_C[j]);
-				for(k=0;k<ci;k++)
-					if(!nonzero[si+k] && fabs(f[p].alpha[k]) > 0)
-						nonzero[si+k] = true;
-				for(k=0;k<cj;k++)
-					if(!nonzero[sj+k] && fabs(f[p].alpha[ci+k]) > 0)
-						nonzero[sj+k] = true;
-				free(sub_prob.x);
-				free(sub_prob.y);
+				pair_ctx.initial_alpha = alpha;
+				f[p] = svm_train_one(&sub_prob,&one_param,weighted_C[i],weighted_C[j],&pair_ctx);
+				pair_ctx.initial_alpha = NULL;
+				free(instance);
+				free(index);
+				free(alpha);
+				delete fold_cache;
+			}
+#ifdef SVM_DEBUG
+			if(pair_ctx.workspace == &thread_workspace)
+				thread_workspace.report();
+#endif
+		}
+
+		p = 0;
+		for(i=0;i<nr_class;i++)
+			for(int j=i+1;j<nr_class;j++)
+			{
+				int k;
+				for(k=0;k<count[i];k++)
+					if(!nonzero[start[i]+k] && fabs(f[p].alpha[k]) > 0)
+						nonzero[start[i]+k] = true;
+				for(k=0;k<count[j];k++)
+					if(!nonzero[start[j]+k] && fabs(f[p].alpha[count[i]+k]) > 0)
+						nonzero[start[j]+k] = true;
 				++p;
 			}
+		if(class_cache)
+		{
+			long int hit, miss;
+			class_cache->get_counts(&hit,&miss);
+			info("shared kernel cache: %ld columns found, %ld missed\n",hit,miss);
+			delete class_cache;
+		}
+		free(job);
+		if(shuffle)
+		{
+			for(p=0;p<nr_pair;p++)
+				free(shuffle[p]);
+			free(shuffle);
+		}
 
 		// build output
 
@@ -2305,44 +6201,463 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 				int ci = count[i];
 				int cj = count[j];
 
-				int q = nz_start[i];
+				int q = nz_start[i];
+				int k;
+				for(k=0;k<ci;k++)
+					if(nonzero[si+k])
+						model->sv_coef[j-1][q++] = f[p].alpha[k];
+				q = nz_start[j];
+				for(k=0;k<cj;k++)
+					if(nonzero[sj+k])
+						model->sv_coef[i][q++] = f[p].alpha[ci+k];
+				++p;
+			}
+
+		free(label);
+		free(probA);
+		free(probB);
+		free(count);
+		free(perm);
+		free(start);
+		free(x);
+		free(weighted_C);
+		free(nonzero);
+		for(i=0;i<nr_class*(nr_class-1)/2;i++)
+			free(f[i].alpha);
+		free(f);
+		free(nz_count);
+		free(nz_start);
+	}
+	if(ctx.checkpoint)
+	{
+		ctx.checkpoint->finish();
+		delete ctx.checkpoint;
+	}
+	close_kernel_file(own_file);
+	if(own_workspace)
+	{
+#ifdef SVM_DEBUG
+		own_workspace->report();
+#endif
+		delete own_workspace;
+		report_peak_rss("training");
+	}
+	return model;
+}
+
+svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
+{
+	return train(prob,param,false,NULL,NULL);
+}
+
+svm_model *svm_train_resume(const svm_problem *prob, const svm_parameter *param)
+{
+	return train(prob,param,true,NULL,NULL);
+}
+
+svm_model *svm_train_warm(const svm_problem *prob, const svm_parameter *param,
+			  const double *initial_alpha)
+{
+	return train(prob,param,false,initial_alpha,NULL);
+}
+
+// the initial alpha, as svm_train_warm takes it, over prob from the
+// solution in model, whose k-th training instance is instance to[k] of
+// prob, or -1 if not in it
+static double *model_alpha(const svm_model *model, const int *to, const svm_problem *prob)
+{
+	int l = prob->l;
+	int i, m;
+
+	// the classes of prob in the order of first appearance
+	int nr_class = 0;
+	int *label = NULL;
+	if(model->label)
+	{
+		int max_nr_class = 16;
+		label = Malloc(int,max_nr_class);
+		for(i=0;i<l;i++)
+		{
+			int this_label = (int)prob->y[i];
+			int c;
+			for(c=0;c<nr_class;c++)
+				if(label[c] == this_label)
+					break;
+			if(c < nr_class)
+				continue;
+			if(nr_class == max_nr_class)
+			{
+				max_nr_class *= 2;
+				label = (int *)realloc(label,max_nr_class*sizeof(int));
+			}
+			label[nr_class++] = this_label;
+		}
+	}
+	int nr_row = max(nr_class-1,1);
+	double *alpha = Malloc(double,(size_t)nr_row*l);
+	for(size_t t=0;t<(size_t)nr_row*l;t++)
+		alpha[t] = 0;
+
+	// the class in prob of each class of model, -1 if not there
+	int *pos = NULL;
+	if(label)
+	{
+		pos = Malloc(int,model->nr_class);
+		for(int c=0;c<model->nr_class;c++)
+		{
+			pos[c] = -1;
+			for(int d=0;d<nr_class;d++)
+				if(label[d] == model->label[c])
+					pos[c] = d;
+		}
+	}
+
+	int c = 0, end = model->nSV ? model->nSV[0] : model->l;
+	for(i=0;i<model->l;i++)
+	{
+		while(pos && i >= end)
+			end += model->nSV[++c];
+		int k = to[model->sv_indices[i]-1];
+		if(k < 0)
+			continue;
+		if(!pos)
+		{
+			alpha[k] = model->sv_coef[0][i];
+			continue;
+		}
+		if(pos[c] < 0)
+			continue;
+		for(m=0;m<model->nr_class-1;m++)
+		{
+			int o = pos[m < c ? m : m+1];
+			if(o >= 0)
+				alpha[(size_t)(o < pos[c] ? o : o-1)*l+k] = model->sv_coef[m][i];
+		}
+	}
+	free(label);
+	free(pos);
+	return alpha;
+}
+
+svm_model **svm_train_path(const svm_problem *prob, const svm_parameter *param,
+			   int nr_value, const double *value)
+{
+	int l = prob->l;
+	int i, k;
+	bool by_nu = param->svm_type == NU_SVC || param->svm_type == ONE_CLASS ||
+		param->svm_type == NU_SVR;
+	bool warm = param->svm_type == C_SVC || param->svm_type == EPSILON_SVR ||
+		param->svm_type == ONE_CLASS;
+	// the trainings would share one checkpoint file
+	svm_parameter path_param = *param;
+	path_param.checkpoint_file = NULL;
+
+	// the trainings share the kernel values over the instances, grouped
+	// by class for classification as the pairs take them, in up to half
+	// of the cache
+	int nr_group = 1;
+	int *label = NULL;
+	int *start = NULL;
+	int *count = NULL;
+	int *index = Malloc(int,l);
+	if(param->svm_type == C_SVC || param->svm_type == NU_SVC)
+	{
+		int *perm = Malloc(int,l);
+		svm_group_classes(prob,&nr_group,&label,&start,&count,perm);
+		for(i=0;i<l;i++)
+			index[perm[i]] = i;
+		free(perm);
+	}
+	else
+	{
+		start = Malloc(int,1);
+		count = Malloc(int,1);
+		start[0] = 0;
+		count[0] = l;
+		for(i=0;i<l;i++)
+			index[i] = i;
+	}
+	SharedCache *kernel_cache = NULL;
+	if(nr_value > 1 && nr_group <= SharedCache::MAX_GROUP)
+	{
+		double shared_size = min(SharedCache::size(l,nr_group,count,false)/(1<<20),param->cache_size/2);
+		kernel_cache = new SharedCache(l,nr_group,start,count,false,(long int)(shared_size*(1<<20)));
+		path_param.cache_size -= shared_size;
+	}
+
+	// each training starts from the solution before it, where the
+	// formulation takes one
+	Workspace workspace;
+	train_context ctx = train_context();
+	ctx.workspace = &workspace;
+	ctx.kernel_cache = kernel_cache;
+	ctx.kernel_index = kernel_cache ? index : NULL;
+	ctx.kernel_file = open_kernel_file(prob,param);
+	svm_model **model = Malloc(svm_model *,nr_value);
+	double *alpha = NULL;
+	int *to = Malloc(int,l);
+	for(i=0;i<l;i++)
+		to[i] = i;
+	for(k=0;k<nr_value;k++)
+	{
+		if(by_nu)
+			path_param.nu = value[k];
+		else
+			path_param.C = value[k];
+		model[k] = train(prob,&path_param,false,alpha,&ctx);
+		free(alpha);
+		alpha = NULL;
+		if(warm && k+1 < nr_value)
+			alpha = model_alpha(model[k],to,prob);
+		// the models refer to the caller's parameters
+		model[k]->param = *param;
+		if(by_nu)
+			model[k]->param.nu = value[k];
+		else
+			model[k]->param.C = value[k];
+	}
+
+	if(kernel_cache)
+	{
+		long int hit, miss;
+		kernel_cache->get_counts(&hit,&miss);
+		info("shared kernel cache: %ld columns found, %ld missed\n",hit,miss);
+		delete kernel_cache;
+	}
+	close_kernel_file(ctx.kernel_file);
+#ifdef SVM_DEBUG
+	workspace.report();
+#endif
+	report_peak_rss("training");
+	free(to);
+	free(index);
+	free(label);
+	free(start);
+	free(count);
+	return model;
+}
+
+// svm_predict_values from the kernel values kvalue[i] = K(x,SV[i])
+static double predict_values(const svm_model *model, const double *kvalue, double* dec_values)
+{
+	int i;
+	if(model->param.svm_type == ONE_CLASS ||
+	   model->param.svm_type == EPSILON_SVR ||
+	   model->param.svm_type == NU_SVR)
+	{
+		double *sv_coef = model->sv_coef[0];
+		double sum = 0;
+		for(i=0;i<model->l;i++)
+			sum += sv_coef[i] * kvalue[i];
+		sum -= model->rho[0];
+		*dec_values = sum;
+
+		if(model->param.svm_type == ONE_CLASS)
+			return (sum>0)?1:-1;
+		else
+			return sum;
+	}
+	else
+	{
+		int nr_class = model->nr_class;
+
+		int *start = Malloc(int,nr_class);
+		start[0] = 0;
+		for(i=1;i<nr_class;i++)
+			start[i] = start[i-1]+model->nSV[i-1];
+
+		int *vote = Malloc(int,nr_class);
+		for(i=0;i<nr_class;i++)
+			vote[i] = 0;
+
+		int p=0;
+		for(i=0;i<nr_class;i++)
+			for(int j=i+1;j<nr_class;j++)
+			{
+				double sum = 0;
+				int si = start[i];
+				int sj = start[j];
+				int ci = model->nSV[i];
+				int cj = model->nSV[j];
+
 				int k;
+				double *coef1 = model->sv_coef[j-1];
+				double *coef2 = model->sv_coef[i];
 				for(k=0;k<ci;k++)
-					if(nonzero[si+k])
-						model->sv_coef[j-1][q++] = f[p].alpha[k];
-				q = nz_start[j];
+					sum += coef1[si+k] * kvalue[si+k];
 				for(k=0;k<cj;k++)
-					if(nonzero[sj+k])
-						model->sv_coef[i][q++] = f[p].alpha[ci+k];
-				++p;
+					sum += coef2[sj+k] * kvalue[sj+k];
+				sum -= model->rho[p];
+				dec_values[p] = sum;
+
+				if(dec_values[p] > 0)
+					++vote[i];
+				else
+					++vote[j];
+				p++;
 			}
 
-		free(label);
-		free(probA);
-		free(probB);
-		free(count);
-		free(perm);
+		int vote_max_idx = 0;
+		for(i=1;i<nr_class;i++)
+			if(vote[i] > vote[vote_max_idx])
+				vote_max_idx = i;
+
 		free(start);
-		free(x);
-		free(weighted_C);
-		free(nonzero);
-		for(i=0;i<nr_class*(nr_class-1)/2;i++)
-			free(f[i].alpha);
-		free(f);
-		free(nz_count);
-		free(nz_start);
+		free(vote);
+		return model->label[vote_max_idx];
 	}
-	return model;
 }
 
-// Stratified cross validation
-void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target)
+// svm_predict_probability from the decision values, for a model with
+// probability information
+static double predict_probability_values(
+	const svm_model *model, const double *dec_values, double *prob_estimates)
+{
+	int i;
+	int nr_class = model->nr_class;
+	double min_prob=1e-7;
+	double **pairwise_prob=Malloc(double *,nr_class);
+	for(i=0;i<nr_class;i++)
+		pairwise_prob[i]=Malloc(double,nr_class);
+	int k=0;
+	for(i=0;i<nr_class;i++)
+		for(int j=i+1;j<nr_class;j++)
+		{
+			pairwise_prob[i][j]=min(max(sigmoid_predict(dec_values[k],model->probA[k],model->probB[k]),min_prob),1-min_prob);
+			pairwise_prob[j][i]=1-pairwise_prob[i][j];
+			k++;
+		}
+	if (nr_class == 2)
+	{
+		prob_estimates[0] = pairwise_prob[0][1];
+		prob_estimates[1] = pairwise_prob[1][0];
+	}
+	else
+		multiclass_probability(nr_class,pairwise_prob,prob_estimates);
+
+	int prob_max_idx = 0;
+	for(i=1;i<nr_class;i++)
+		if(prob_estimates[i] > prob_estimates[prob_max_idx])
+			prob_max_idx = i;
+	for(i=0;i<nr_class;i++)
+		free(pairwise_prob[i]);
+	free(pairwise_prob);
+	return model->label[prob_max_idx];
+}
+
+// target[i] = svm_predict(model,x[i]) for i in index[0,n), or
+// svm_predict_probability with probability; the kernel values of each
+// x[i] are computed as one column over the SVs
+static void predict_batch(const svm_model *model, svm_node * const *x, const int *index,
+			  int n, bool probability, double *target)
+{
+	int l = model->l;
+	int nr_class = model->nr_class;
+	int k;
+	svm_node **node = Malloc(svm_node *,l+n);
+	for(k=0;k<l;k++)
+		node[k] = model->SV[k];
+	for(k=0;k<n;k++)
+		node[l+k] = x[index[k]];
+	PredictKernel kernel(l+n,node,model->param);
+	free(node);
+
+	probability = probability && model->probA != NULL && model->probB != NULL &&
+		(model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC);
+	double *kvalue = Malloc(double,l);
+	double *dec_values = Malloc(double,max(nr_class*(nr_class-1)/2,1));
+	double *prob_estimates = Malloc(double,nr_class);
+	for(k=0;k<n;k++)
+	{
+		kernel.column(l+k,0,l,kvalue);
+		double v = predict_values(model,kvalue,dec_values);
+		if(probability)
+			v = predict_probability_values(model,dec_values,prob_estimates);
+		target[index[k]] = v;
+	}
+	free(kvalue);
+	free(dec_values);
+	free(prob_estimates);
+}
+
+// fold i of cross_validation: train on the instances perm[j] for j out
+// of [fold_start[i],fold_start[i+1]), from the solution of fold
+// from_fold if its model from is given, and predict the others into
+// target; the instance of perm[j] in the shared cache of ctx is j, or
+// outer_index[perm[j]]
+static svm_model *train_fold(const svm_problem *prob, const svm_parameter *param,
+			     const int *perm, const int *fold_start, int i,
+			     const svm_model *from, int from_fold, const int *outer_index,
+			     train_context *ctx, double *target)
+{
+	int l = prob->l;
+	int begin = fold_start[i];
+	int end = fold_start[i+1];
+	int j,k;
+	struct svm_problem subprob;
+
+	subprob.l = l-(end-begin);
+	subprob.x = Malloc(struct svm_node*,subprob.l);
+	subprob.y = Malloc(double,subprob.l);
+	int *index = Malloc(int,subprob.l);
+
+	k=0;
+	for(j=0;j<begin;j++)
+	{
+		subprob.x[k] = prob->x[perm[j]];
+		subprob.y[k] = prob->y[perm[j]];
+		index[k] = j;
+		++k;
+	}
+	for(j=end;j<l;j++)
+	{
+		subprob.x[k] = prob->x[perm[j]];
+		subprob.y[k] = prob->y[perm[j]];
+		index[k] = j;
+		++k;
+	}
+	if(outer_index)
+		for(k=0;k<subprob.l;k++)
+			index[k] = outer_index[perm[index[k]]];
+
+	double *alpha = NULL;
+	if(from)
+	{
+		// from left out [fold_start[from_fold],fold_start[from_fold+1])
+		int from_begin = fold_start[from_fold];
+		int from_end = fold_start[from_fold+1];
+		int n = l-(from_end-from_begin);
+		int *to = Malloc(int,n);
+		for(k=0;k<n;k++)
+		{
+			j = k < from_begin ? k : k+(from_end-from_begin);
+			to[k] = j < begin ? j : (j < end ? -1 : j-(end-begin));
+		}
+		alpha = model_alpha(from,to,&subprob);
+		free(to);
+	}
+
+	ctx->kernel_index = index;
+	struct svm_model *submodel = train(&subprob,param,false,alpha,ctx);
+	predict_batch(submodel,prob->x,&perm[begin],end-begin,param->probability != 0,target);
+	free(subprob.x);
+	free(subprob.y);
+	free(index);
+	free(alpha);
+	return submodel;
+}
+
+// split the instances of prob into *nr_fold folds, stratified for
+// classification: fold i is perm[j] for j in [fold_start[i],fold_start[i+1]);
+// returns fold_start
+static int *fold_split(const svm_problem *prob, const svm_parameter *param, int *nr_fold_ret,
+		       int *perm, unsigned long long *random_state)
 {
 	int i;
 	int *fold_start;
 	int l = prob->l;
-	int *perm = Malloc(int,l);
 	int nr_class;
+	int nr_fold = *nr_fold_ret;
 	if (nr_fold > l)
 	{
 		nr_fold = l;
@@ -2368,7 +6683,7 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 		for (c=0; c<nr_class; c++)
 			for(i=0;i<count[c];i++)
 			{
-				int j = i+rand()%(count[c]-i);
+				int j = i+next_random(random_state)%(count[c]-i);
 				swap(index[start[c]+j],index[start[c]+i]);
 			}
 		for(i=0;i<nr_fold;i++)
@@ -2405,53 +6720,301 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 		for(i=0;i<l;i++) perm[i]=i;
 		for(i=0;i<l;i++)
 		{
-			int j = i+rand()%(l-i);
+			int j = i+next_random(random_state)%(l-i);
 			swap(perm[i],perm[j]);
 		}
 		for(i=0;i<=nr_fold;i++)
 			fold_start[i]=i*l/nr_fold;
 	}
 
-	for(i=0;i<nr_fold;i++)
+	*nr_fold_ret = nr_fold;
+	return fold_start;
+}
+
+// the kernel values over the instances in the order of perm, grouped by
+// fold (or by runs of folds), in at most max_size MB; the size taken is
+// stored in *size
+static SharedCache *fold_cache(int l, int nr_fold, const int *fold_start, double max_size,
+			       double *size)
+{
+	int nr_group = min(nr_fold,(int)SharedCache::MAX_GROUP);
+	int start[SharedCache::MAX_GROUP], count[SharedCache::MAX_GROUP];
+	for(int c=0;c<nr_group;c++)
 	{
-		int begin = fold_start[i];
-		int end = fold_start[i+1];
-		int j,k;
-		struct svm_problem subprob;
+		start[c] = fold_start[c*nr_fold/nr_group];
+		count[c] = fold_start[(c+1)*nr_fold/nr_group]-start[c];
+	}
+	*size = min(SharedCache::size(l,nr_group,count,false)/(1<<20),max_size);
+	return new SharedCache(l,nr_group,start,count,false,(long int)(*size*(1<<20)));
+}
+
+// Stratified cross validation
+static void cross_validation(const svm_problem *prob, const svm_parameter *param,
+			     int nr_fold, double *target, const train_context *outer)
+{
+	int i;
+	// the folds would share one checkpoint file
+	svm_parameter subparam = *param;
+	subparam.checkpoint_file = NULL;
+	int l = prob->l;
+	int *perm = Malloc(int,l);
+	unsigned long long *random_state = outer ? outer->random_state : NULL;
+	int *fold_start = fold_split(prob,param,&nr_fold,perm,random_state);
 
-		subprob.l = l-(end-begin);
-		subprob.x = Malloc(struct svm_node*,subprob.l);
-		subprob.y = Malloc(double,subprob.l);
+	// each fold draws from its own state, so that the result does not
+	// depend on the threads
+	unsigned long long *fold_state = Malloc(unsigned long long,nr_fold);
+	for(i=0;i<nr_fold;i++)
+		fold_state[i] = (unsigned long long)next_random(random_state);
+
+	// the folds share the kernel values over the instances in the order
+	// of perm, grouped by fold (or by runs of folds), in up to half of
+	// the cache; a cache of the caller is taken instead
+	SharedCache *kernel_cache = NULL;
+	if(outer && outer->kernel_cache)
+		kernel_cache = outer->kernel_cache;
+	else if(nr_fold > 1)
+	{
+		double shared_size;
+		kernel_cache = fold_cache(l,nr_fold,fold_start,param->cache_size/2,&shared_size);
+		subparam.cache_size -= shared_size;
+	}
 
-		k=0;
-		for(j=0;j<begin;j++)
+	// folds run side by side with more than one thread, each solved on
+	// one thread with its part of the cache; with C-SVC and epsilon-SVR
+	// the first fold is trained before them, on all threads, and the
+	// others start from its solution over the instances they share
+	Workspace *own_workspace = outer ? NULL : new Workspace;
+	const int *outer_index = outer && outer->kernel_cache ? outer->kernel_index : NULL;
+	KernelFile *own_file = outer ? NULL : open_kernel_file(prob,param);
+	KernelFile *kernel_file = outer ? outer->kernel_file : own_file;
+	svm_model *first = NULL;
+	if((param->svm_type == C_SVC || param->svm_type == EPSILON_SVR) && nr_fold > 1)
+	{
+		train_context fold_ctx = train_context();
+		fold_ctx.workspace = outer ? outer->workspace : own_workspace;
+		fold_ctx.kernel_cache = kernel_cache;
+		fold_ctx.kernel_file = kernel_file;
+		fold_ctx.random_state = &fold_state[0];
+		first = train_fold(prob,&subparam,perm,fold_start,0,NULL,0,outer_index,&fold_ctx,target);
+	}
+#ifdef _OPENMP
+	int nr_fold_thread = 1;
+	int nr_thread = param->nr_thread > 0 ? param->nr_thread : omp_get_max_threads();
+	if(nr_thread > 1 && nr_fold > 1)
+	{
+		nr_fold_thread = min(nr_thread,nr_fold);
+		subparam.nr_thread = 1;
+		subparam.cache_size /= nr_fold_thread;
+		subparam.spill_size /= nr_fold_thread;
+	}
+#pragma omp parallel num_threads(nr_fold_thread) if(nr_fold_thread > 1)
+#endif
+	{
+		train_context fold_ctx = train_context();
+		Workspace thread_workspace;
+		fold_ctx.workspace = outer ? outer->workspace : own_workspace;
+		fold_ctx.kernel_cache = kernel_cache;
+		fold_ctx.kernel_file = kernel_file;
+#ifdef _OPENMP
+		if(omp_get_thread_num() > 0)
+			fold_ctx.workspace = &thread_workspace;
+#pragma omp for schedule(dynamic,1)
+#endif
+		for(i=first ? 1 : 0;i<nr_fold;i++)
 		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
+			fold_ctx.random_state = &fold_state[i];
+			svm_model *submodel = train_fold(prob,&subparam,perm,fold_start,i,first,0,
+							 outer_index,&fold_ctx,target);
+			svm_free_and_destroy_model(&submodel);
 		}
-		for(j=end;j<l;j++)
+#ifdef SVM_DEBUG
+		if(fold_ctx.workspace == &thread_workspace)
+			thread_workspace.report();
+#endif
+	}
+	if(first)
+		svm_free_and_destroy_model(&first);
+	if(kernel_cache && !(outer && outer->kernel_cache))
+	{
+		long int hit, miss;
+		kernel_cache->get_counts(&hit,&miss);
+		info("shared kernel cache: %ld columns found, %ld missed\n",hit,miss);
+		delete kernel_cache;
+	}
+	close_kernel_file(own_file);
+	if(own_workspace)
+	{
+#ifdef SVM_DEBUG
+		own_workspace->report();
+#endif
+		delete own_workspace;
+		report_peak_rss("cross validation");
+	}
+	free(fold_state);
+	free(fold_start);
+	free(perm);
+}
+
+void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target)
+{
+	cross_validation(prob,param,nr_fold,target,NULL);
+}
+
+// Grid search: the cross validation rate at each (C, gamma) over one
+// split of the data, as svm_cross_validation gives it
+void svm_grid_search(const svm_problem *prob, const svm_parameter *param, int nr_fold,
+		     int nr_C, const double *C, int nr_gamma, const double *gamma, double *rate)
+{
+	int i, g, c;
+	int l = prob->l;
+	svm_parameter subparam = *param;
+	subparam.checkpoint_file = NULL;
+	if(!C)
+		nr_C = 1;
+	if(!gamma)
+		nr_gamma = 1;
+	int *perm = Malloc(int,l);
+	int *fold_start = fold_split(prob,param,&nr_fold,perm,NULL);
+	unsigned long long *fold_state = Malloc(unsigned long long,nr_fold);
+	for(i=0;i<nr_fold;i++)
+		fold_state[i] = (unsigned long long)next_random(NULL);
+
+	// each fold goes through C upwards; with C-SVC and epsilon-SVR it
+	// starts from its solution at the C before, which stays feasible
+	// (scaling it up to the new C took more iterations than none)
+	int *order = Malloc(int,nr_C);
+	for(c=0;c<nr_C;c++)
+	{
+		for(i=c;i>0 && C[order[i-1]] > C[c];i--)
+			order[i] = order[i-1];
+		order[i] = c;
+	}
+	bool warm = param->svm_type == C_SVC || param->svm_type == EPSILON_SVR;
+	double *target = Malloc(double,(size_t)nr_gamma*nr_C*l);
+
+	// the (gamma, fold) tasks run side by side with more than one thread,
+	// each solved on one thread with its part of the cache
+	int nr_task = nr_gamma*nr_fold;
+	int nr_grid_thread = 1;
+#ifdef _OPENMP
+	int nr_thread = param->nr_thread > 0 ? param->nr_thread : omp_get_max_threads();
+	if(nr_thread > 1 && nr_task > 1)
+	{
+		nr_grid_thread = min(nr_thread,nr_task);
+		subparam.nr_thread = 1;
+	}
+#endif
+
+	// the folds of a gamma share the kernel values in up to half of the
+	// cache, split over the gammas worked on at once; the cache of a
+	// gamma is made by the first of its tasks and freed by the last
+	SharedCache **kernel_cache = Malloc(SharedCache *,nr_gamma);
+	int *nr_left = Malloc(int,nr_gamma);
+	for(g=0;g<nr_gamma;g++)
+	{
+		kernel_cache[g] = NULL;
+		nr_left[g] = nr_fold;
+	}
+	double shared_size = 0;
+	if(nr_fold > 1)
+	{
+		int nr_active = min(nr_gamma,(nr_grid_thread+nr_fold-2)/nr_fold+1);
+		shared_size = param->cache_size/2/nr_active;
+		subparam.cache_size /= 2;
+	}
+	subparam.cache_size /= nr_grid_thread;
+	subparam.spill_size /= nr_grid_thread;
+
+	Workspace *own_workspace = new Workspace;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nr_grid_thread) if(nr_grid_thread > 1)
+#endif
+	{
+		train_context task_ctx = train_context();
+		Workspace thread_workspace;
+		task_ctx.workspace = own_workspace;
+#ifdef _OPENMP
+		if(omp_get_thread_num() > 0)
+			task_ctx.workspace = &thread_workspace;
+#pragma omp for schedule(dynamic,1)
+#endif
+		for(int t=0;t<nr_task;t++)
 		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
+			int tg = t/nr_fold;
+			int f = t%nr_fold;
+			svm_parameter task_param = subparam;
+			if(gamma)
+				task_param.gamma = gamma[tg];
+#ifdef _OPENMP
+#pragma omp critical(grid_cache)
+#endif
+			{
+				if(!kernel_cache[tg] && nr_fold > 1)
+				{
+					double size;
+					kernel_cache[tg] = fold_cache(l,nr_fold,fold_start,shared_size,&size);
+				}
+				task_ctx.kernel_cache = kernel_cache[tg];
+			}
+
+			svm_model *prev = NULL;
+			for(int k=0;k<nr_C;k++)
+			{
+				int tc = order[k];
+				if(C)
+					task_param.C = C[tc];
+				// each point draws as a run of its own would
+				unsigned long long state = fold_state[f];
+				task_ctx.random_state = &state;
+				svm_model *submodel = train_fold(prob,&task_param,perm,fold_start,f,
+								 warm ? prev : NULL,f,NULL,&task_ctx,
+								 &target[((size_t)tg*nr_C+tc)*l]);
+				if(prev)
+					svm_free_and_destroy_model(&prev);
+				prev = submodel;
+			}
+			svm_free_and_destroy_model(&prev);
+
+#ifdef _OPENMP
+#pragma omp critical(grid_cache)
+#endif
+			if(--nr_left[tg] == 0 && kernel_cache[tg])
+			{
+				delete kernel_cache[tg];
+				kernel_cache[tg] = NULL;
+			}
 		}
-		struct svm_model *submodel = svm_train(&subprob,param);
-		if(param->probability &&
-		   (param->svm_type == C_SVC || param->svm_type == NU_SVC))
+#ifdef SVM_DEBUG
+		if(task_ctx.workspace == &thread_workspace)
+			thread_workspace.report();
+#endif
+	}
+#ifdef SVM_DEBUG
+	own_workspace->report();
+#endif
+	delete own_workspace;
+	report_peak_rss("grid search");
+
+	bool regression = param->svm_type == EPSILON_SVR || param->svm_type == NU_SVR;
+	for(g=0;g<nr_gamma;g++)
+		for(c=0;c<nr_C;c++)
 		{
-			double *prob_estimates=Malloc(double,svm_get_nr_class(submodel));
-			for(j=begin;j<end;j++)
-				target[perm[j]] = svm_predict_probability(submodel,prob->x[perm[j]],prob_estimates);
-			free(prob_estimates);
+			const double *point_target = &target[((size_t)g*nr_C+c)*l];
+			double total = 0;
+			for(i=0;i<l;i++)
+				if(regression)
+					total += (point_target[i]-prob->y[i])*(point_target[i]-prob->y[i]);
+				else if(point_target[i] == prob->y[i])
+					++total;
+			rate[g*nr_C+c] = regression ? total/l : 100.0*total/l;
 		}
-		else
-			for(j=begin;j<end;j++)
-				target[perm[j]] = svm_predict(submodel,prob->x[perm[j]]);
-		svm_free_and_destroy_model(&submodel);
-		free(subprob.x);
-		free(subprob.y);
-	}
+
+	free(kernel_cache);
+	free(nr_left);
+	free(target);
+	free(order);
+	free(fold_state);
 	free(fold_start);
 	free(perm);
 }
@@ -2500,78 +7063,13 @@ double svm_get_svr_probability(const svm_model *model)
 
 double svm_predict_values(const svm_model *model, const svm_node *x, double* dec_values)
 {
-	int i;
-	if(model->param.svm_type == ONE_CLASS ||
-	   model->param.svm_type == EPSILON_SVR ||
-	   model->param.svm_type == NU_SVR)
-	{
-		double *sv_coef = model->sv_coef[0];
-		double sum = 0;
-		for(i=0;i<model->l;i++)
-			sum += sv_coef[i] * Kernel::k_function(x,model->SV[i],model->param);
-		sum -= model->rho[0];
-		*dec_values = sum;
-
-		if(model->param.svm_type == ONE_CLASS)
-			return (sum>0)?1:-1;
-		else
-			return sum;
-	}
-	else
-	{
-		int nr_class = model->nr_class;
-		int l = model->l;
-
-		double *kvalue = Malloc(double,l);
-		for(i=0;i<l;i++)
-			kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
-
-		int *start = Malloc(int,nr_class);
-		start[0] = 0;
-		for(i=1;i<nr_class;i++)
-			start[i] = start[i-1]+model->nSV[i-1];
-
-		int *vote = Malloc(int,nr_class);
-		for(i=0;i<nr_class;i++)
-			vote[i] = 0;
-
-		int p=0;
-		for(i=0;i<nr_class;i++)
-			for(int j=i+1;j<nr_class;j++)
-			{
-				double sum = 0;
-				int si = start[i];
-				int sj = start[j];
-				int ci = model->nSV[i];
-				int cj = model->nSV[j];
-
-				int k;
-				double *coef1 = model->sv_coef[j-1];
-				double *coef2 = model->sv_coef[i];
-				for(k=0;k<ci;k++)
-					sum += coef1[si+k] * kvalue[si+k];
-				for(k=0;k<cj;k++)
-					sum += coef2[sj+k] * kvalue[sj+k];
-				sum -= model->rho[p];
-				dec_values[p] = sum;
-
-				if(dec_values[p] > 0)
-					++vote[i];
-				else
-					++vote[j];
-				p++;
-			}
-
-		int vote_max_idx = 0;
-		for(i=1;i<nr_class;i++)
-			if(vote[i] > vote[vote_max_idx])
-				vote_max_idx = i;
-
-		free(kvalue);
-		free(start);
-		free(vote);
-		return model->label[vote_max_idx];
-	}
+	int l = model->l;
+	double *kvalue = Malloc(double,l);
+	for(int i=0;i<l;i++)
+		kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
+	double pred_result = predict_values(model,kvalue,dec_values);
+	free(kvalue);
+	return pred_result;
 }
 
 double svm_predict(const svm_model *model, const svm_node *x)
@@ -2595,40 +7093,12 @@ double svm_predict_probability(
 	if ((model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC) &&
 	    model->probA!=NULL && model->probB!=NULL)
 	{
-		int i;
 		int nr_class = model->nr_class;
 		double *dec_values = Malloc(double, nr_class*(nr_class-1)/2);
 		svm_predict_values(model, x, dec_values);
-
-		double min_prob=1e-7;
-		double **pairwise_prob=Malloc(double *,nr_class);
-		for(i=0;i<nr_class;i++)
-			pairwise_prob[i]=Malloc(double,nr_class);
-		int k=0;
-		for(i=0;i<nr_class;i++)
-			for(int j=i+1;j<nr_class;j++)
-			{
-				pairwise_prob[i][j]=min(max(sigmoid_predict(dec_values[k],model->probA[k],model->probB[k]),min_prob),1-min_prob);
-				pairwise_prob[j][i]=1-pairwise_prob[i][j];
-				k++;
-			}
-		if (nr_class == 2)
-		{
-			prob_estimates[0] = pairwise_prob[0][1];
-			prob_estimates[1] = pairwise_prob[1][0];
-		}
-		else
-			multiclass_probability(nr_class,pairwise_prob,prob_estimates);
-
-		int prob_max_idx = 0;
-		for(i=1;i<nr_class;i++)
-			if(prob_estimates[i] > prob_estimates[prob_max_idx])
-				prob_max_idx = i;
-		for(i=0;i<nr_class;i++)
-			free(pairwise_prob[i]);
+		double pred_result = predict_probability_values(model, dec_values, prob_estimates);
 		free(dec_values);
-		free(pairwise_prob);
-		return model->label[prob_max_idx];
+		return pred_result;
 	}
 	else
 		return svm_predict(model, x);
@@ -2993,6 +7463,42 @@ svm_model *svm_load_model(const char *model_file_name)
 	return model;
 }
 
+void svm_compact_model(svm_model *model)
+{
+	if(model->free_sv || model->l == 0)
+		return;
+
+	// the nodes of each SV, of which a precomputed kernel takes only
+	// the first, the serial number
+	bool precomputed = model->param.kernel_type == PRECOMPUTED;
+	int i;
+	int *nnz = Malloc(int,model->l);
+	size_t elements = 0;
+	for(i=0;i<model->l;i++)
+	{
+		const svm_node *p = model->SV[i];
+		int n = 0;
+		while(p[n].index != -1 && !(precomputed && n > 0))
+			n++;
+		nnz[i] = n;
+		elements += (size_t)n+1;
+	}
+
+	svm_node *x_space = Malloc(svm_node,elements);
+	svm_node *q = x_space;
+	for(i=0;i<model->l;i++)
+	{
+		memcpy(q,model->SV[i],sizeof(svm_node)*(size_t)nnz[i]);
+		model->SV[i] = q;
+		q += nnz[i];
+		q->index = -1;
+		q->value = 0;
+		q++;
+	}
+	free(nnz);
+	model->free_sv = 1;
+}
+
 void svm_free_model_content(svm_model* model_ptr)
 {
 	if(model_ptr->free_sv && model_ptr->l > 0 && model_ptr->SV != NULL)
@@ -3072,11 +7578,32 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 	if(param->degree < 0)
 		return "degree of polynomial kernel < 0";
 
-	// cache_size,eps,C,nu,p,shrinking
+	// cache_size,spill_size,eps,C,nu,p,shrinking
 
 	if(param->cache_size <= 0)
 		return "cache_size <= 0";
 
+	if(param->spill_size < 0)
+		return "spill_size < 0";
+
+	if(param->nr_thread < 0)
+		return "nr_thread < 0";
+
+	if(param->working_set_size < 0)
+		return "working_set_size < 0";
+
+	if(param->max_iter < 0)
+		return "max_iter < 0";
+
+	if(param->max_time < 0)
+		return "max_time < 0";
+
+	if(param->checkpoint_file && param->checkpoint_interval <= 0)
+		return "checkpoint_interval <= 0";
+
+	if(param->kernel_file && param->kernel_file_size <= 0)
+		return "kernel_file_size <= 0";
+
 	if(param->eps <= 0)
 		return "eps <= 0";
 
@@ -3096,9 +7623,8 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 		if(param->p < 0)
 			return "p < 0";
 
-	if(param->shrinking != 0 &&
-	   param->shrinking != 1)
-		return "shrinking != 0 and shrinking != 1";
+	if(param->shrinking < 0 || param->shrinking > 2)
+		return "shrinking < 0 or shrinking > 2";
 
 	if(param->probability != 0 &&
 	   param->probability != 1)
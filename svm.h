@@ -1,7 +1,7 @@
 #ifndef _LIBSVM_H
 #define _LIBSVM_H
 
-#define LIBSVM_VERSION 323
+#define LIBSVM_VERSION 324
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +45,15 @@ struct svm_parameter
 	int shrinking;	/* use the shrinking heuristics */
 	int probability; /* do probability estimates */
 	int num_train; /* total number of training instances */
+	int nr_thread; /* threads for kernel evaluation, 0 for all available */
+	int working_set_size; /* variables per SMO iteration, 2 for pairs */
+	int max_iter;	/* iterations per subproblem, 0 for the default limit */
+	double max_time;	/* seconds for the whole training, 0 for no limit */
+	const char *checkpoint_file;	/* NULL for no checkpoints */
+	double checkpoint_interval;	/* seconds between checkpoints */
+	const char *kernel_file;	/* NULL for no kernel file */
+	double kernel_file_size;	/* in MB */
+	double spill_size; /* in MB, overflow cache for columns evicted from the cache */
 };
 
 //
@@ -73,7 +82,11 @@ struct svm_model
 };
 
 struct svm_model *svm_train(const struct svm_problem *prob, const struct svm_parameter *param);
+struct svm_model *svm_train_resume(const struct svm_problem *prob, const struct svm_parameter *param);
+struct svm_model *svm_train_warm(const struct svm_problem *prob, const struct svm_parameter *param, const double *initial_alpha);
+struct svm_model **svm_train_path(const struct svm_problem *prob, const struct svm_parameter *param, int nr_value, const double *value);
 void svm_cross_validation(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, double *target);
+void svm_grid_search(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, int nr_C, const double *C, int nr_gamma, const double *gamma, double *rate);
 
 int svm_save_model(const char *model_file_name, const struct svm_model *model);
 struct svm_model *svm_load_model(const char *model_file_name);
@@ -89,6 +102,7 @@ double svm_predict_values(const struct svm_model *model, const struct svm_node *
 double svm_predict(const struct svm_model *model, const struct svm_node *x);
 double svm_predict_probability(const struct svm_model *model, const struct svm_node *x, double* prob_estimates);
 
+void svm_compact_model(struct svm_model *model);
 void svm_free_model_content(struct svm_model *model_ptr);
 void svm_free_and_destroy_model(struct svm_model **model_ptr_ptr);
 void svm_destroy_param(struct svm_parameter *param);
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Regression checks run by "make check" from the top directory
+status=0
+tmp=${TMPDIR:-/tmp}/libsvm-check.$$
+mkdir -p $tmp
+
+fail()
+{
+	echo "FAIL: $1"
+	status=1
+}
+
+# RBF and sigmoid kernels on unscaled features up to 1e8, where the
+# exponent of the kernel is far below -745: the off-diagonal kernel
+# values are 0, so every instance is an SV and is fitted
+for t in 2 3
+do
+	./svm-train -q -t $t tests/large_values $tmp/large.model
+	if grep -a -q nan $tmp/large.model
+	then
+		fail "large feature values, -t $t: nan in the model"
+	fi
+done
+./svm-train -q tests/large_values $tmp/large.model
+./svm-predict tests/large_values $tmp/large.model $tmp/large.out > $tmp/large.txt
+grep -q "Accuracy = 100%" $tmp/large.txt || fail "large feature values, -t 2: `cat $tmp/large.txt`"
+
+# epsilon-SVR on 5000 instances, large enough for the solver to prefetch
+# columns with threads: the models with a kernel file, new and reused,
+# are those of one thread
+awk 'BEGIN {
+	srand(1)
+	for(i=0;i<5000;i++) {
+		y = 0; x = ""
+		for(j=1;j<=20;j++) {
+			v = 2*rand()-1
+			y += v*(j%3-1)
+			x = x " " j ":" v
+		}
+		print y+0.3*(rand()-0.5) x
+	}
+}' > $tmp/regression
+./svm-train -q -s 3 -j 1 $tmp/regression $tmp/svr.model
+for run in new reused
+do
+	./svm-train -q -s 3 -j 4 -f $tmp/kernel $tmp/regression $tmp/svr_kf.model
+	cmp -s $tmp/svr.model $tmp/svr_kf.model || fail "epsilon-SVR, -j 4 -f with a $run kernel file: model differs from -j 1"
+done
+
+# the folds of cross validation share a kernel cache, with fold 0 on all
+# threads: the results are those of one thread
+for j in 1 4
+do
+	./svm-train -q -s 3 -v 5 -j $j $tmp/regression > $tmp/cv$j.txt
+done
+cmp -s $tmp/cv1.txt $tmp/cv4.txt || fail "epsilon-SVR, -v 5: -j 4 gives `head -1 $tmp/cv4.txt`, -j 1 gives `head -1 $tmp/cv1.txt`"
+
+# four classes of unequal sizes, whose pairs are solved largest first,
+# so a checkpoint has empty records of pairs not reached: a training
+# killed once the checkpoint is there resumes to the model of one run
+awk 'BEGIN {
+	srand(3)
+	split("300 2500 600 2000",n," ")
+	for(c=1;c<=4;c++)
+		for(i=0;i<n[c];i++) {
+			x = ""
+			for(j=1;j<=10;j++)
+				x = x " " j ":" rand()+(j==c)*0.5
+			print c x
+		}
+}' > $tmp/classes
+./svm-train -q -c 100 $tmp/classes $tmp/classes.model
+./svm-train -q -c 100 -k $tmp/checkpoint -K 0.0001 $tmp/classes $tmp/killed.model &
+pid=$!
+while [ ! -f $tmp/checkpoint ] && kill -0 $pid 2>/dev/null
+do
+	sleep 0.05
+done
+kill $pid 2>/dev/null
+wait $pid 2>/dev/null
+./svm-train -c 100 -k $tmp/checkpoint $tmp/classes $tmp/resumed.model > $tmp/resumed.txt
+if grep -q "checkpoint .* is" $tmp/resumed.txt
+then
+	fail "multi-class, killed and resumed: `grep "checkpoint .* is" $tmp/resumed.txt`"
+fi
+cmp -s $tmp/classes.model $tmp/resumed.model || fail "multi-class, killed and resumed: model differs from one run"
+
+rm -rf $tmp
+[ $status = 0 ] && echo "all checks passed"
+exit $status